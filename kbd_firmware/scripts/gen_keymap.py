@@ -0,0 +1,379 @@
+#!/usr/bin/env python3
+"""Compile layout.keymap into flat, const lookup tables (keymap_table.h).
+
+The layer 0 fallback and the ctrl/cmd swap are resolved here, so the firmware
+looks up a key with a single index operation:
+key_map[ctrl_cmd_swapped][layer][row][col]
+"""
+
+import argparse
+import re
+import sys
+
+MODIFIERS = {
+    "LCTRL": "KEY_MOD_LCTRL",
+    "LSHIFT": "KEY_MOD_LSHIFT",
+    "LALT": "KEY_MOD_LALT",
+    "LMETA": "KEY_MOD_LMETA",
+    "RCTRL": "KEY_MOD_RCTRL",
+    "RSHIFT": "KEY_MOD_RSHIFT",
+    "RALT": "KEY_MOD_RALT",
+    "RMETA": "KEY_MOD_RMETA",
+}
+
+# modifier keys report their modifier bit as well
+MODIFIER_KEYS = {
+    "LEFTCTRL": "LCTRL",
+    "LEFTSHIFT": "LSHIFT",
+    "LEFTALT": "LALT",
+    "LEFTMETA": "LMETA",
+    "RIGHTCTRL": "RCTRL",
+    "RIGHTSHIFT": "RSHIFT",
+    "RIGHTALT": "RALT",
+    "RIGHTMETA": "RMETA",
+}
+
+CTRL_CMD_SWAP = {"LEFTCTRL": "LEFTMETA", "LEFTMETA": "LEFTCTRL"}
+
+# US layout keys for the characters in macro strings, (key, shifted)
+ASCII_KEYS = {" ": ("SPACE", False), "\n": ("ENTER", False), "\t": ("TAB", False)}
+ASCII_KEYS.update({c: (c.upper(), False) for c in "abcdefghijklmnopqrstuvwxyz"})
+ASCII_KEYS.update({c: (c, True) for c in "ABCDEFGHIJKLMNOPQRSTUVWXYZ"})
+ASCII_KEYS.update({c: (c, False) for c in "0123456789"})
+ASCII_KEYS.update({c: (k, True) for c, k in zip("!@#$%^&*()", "1234567890")})
+for unshifted, shifted, key in (
+    ("-", "_", "MINUS"),
+    ("=", "+", "EQUAL"),
+    ("[", "{", "LEFTBRACE"),
+    ("]", "}", "RIGHTBRACE"),
+    ("\\", "|", "BACKSLASH"),
+    (";", ":", "SEMICOLON"),
+    ("'", '"', "APOSTROPHE"),
+    ("`", "~", "GRAVE"),
+    (",", "<", "COMMA"),
+    (".", ">", "DOT"),
+    ("/", "?", "SLASH"),
+):
+    ASCII_KEYS[unshifted] = (key, False)
+    ASCII_KEYS[shifted] = (key, True)
+
+# layer actions, name -> (C action, takes a tap key)
+ACTIONS = {
+    "MO": ("ACTION_MOMENTARY", False),
+    "TG": ("ACTION_TOGGLE", False),
+    "OSL": ("ACTION_ONE_SHOT", False),
+    "LT": ("ACTION_LAYER_TAP", True),
+    "M": ("ACTION_MACRO", False),
+}
+
+# (key, modifiers, action, layer number)
+NO_KEY = (None, (), None, None)
+
+LAYER_RE = re.compile(r"^layer\s+(\d+)$")
+COMBO_RE = re.compile(r"^combo\s+([\d,\s]+?)\s*=\s*(\S+)$")
+MACRO_RE = re.compile(r"^macro\s+(\d+)\s*=\s*(.+)$")
+MACRO_TOKEN_RE = re.compile(r'"((?:[^"\\]|\\.)*)"|(\S+)')
+ACTION_RE = re.compile(r"^([A-Z]+)\(([^,()]+)(?:,(.+))?\)$")
+
+
+class LayoutError(Exception):
+    pass
+
+
+def parse_entry(token, where):
+    if token == "_":
+        return NO_KEY
+    m = ACTION_RE.match(token)
+    if not m:
+        return parse_key(token, where)
+    name, arg, tap = m.groups()
+    if name == "MT":
+        # modifiers while held, tap key when tapped
+        if tap is None:
+            raise LayoutError(f"{where}: MT needs a tap key")
+        mods = arg.split("+")
+        if any(mod not in MODIFIERS for mod in mods):
+            raise LayoutError(f"{where}: bad modifiers for MT: {arg!r}")
+        key, tap_mods, _, _ = parse_key(tap, where)
+        if tap_mods:
+            raise LayoutError(f"{where}: MT tap key can't have modifiers")
+        return (key, tuple(mods), "ACTION_MOD_TAP", None)
+    if name not in ACTIONS:
+        raise LayoutError(f"{where}: unknown action {name!r}")
+    action, has_tap = ACTIONS[name]
+    if has_tap != (tap is not None) or not arg.isdigit():
+        raise LayoutError(f"{where}: bad arguments for {name}")
+    if name == "M":
+        # the macro index is stored in the key field
+        return (int(arg), (), action, None)
+    key, mods = parse_key(tap, where)[:2] if tap else (None, ())
+    return (key, mods, action, int(arg))
+
+
+def parse_key(token, where):
+    *mods, key = token.split("+")
+    for mod in mods:
+        if mod not in MODIFIERS:
+            raise LayoutError(f"{where}: unknown modifier {mod!r}")
+    if not re.fullmatch(r"[A-Z0-9_]+", key):
+        raise LayoutError(f"{where}: bad key name {key!r}")
+    if key in MODIFIER_KEYS:
+        mods.append(MODIFIER_KEYS[key])
+    return (key, tuple(mods), None, None)
+
+
+def parse_layout(path):
+    layers = []  # (number, grid)
+    combos = []  # ([(row, col)], entry)
+    macros = {}  # number -> [entry]
+    with open(path) as f:
+        for lineno, raw_line in enumerate(f, 1):
+            line = raw_line.split("#", 1)[0].strip()
+            where = f"{path}:{lineno}"
+            if not line:
+                continue
+            m = LAYER_RE.match(line)
+            if m:
+                number = int(m.group(1))
+                if any(number == n for n, _ in layers):
+                    raise LayoutError(f"{where}: duplicate layer {number}")
+                layers.append((number, []))
+                continue
+            m = MACRO_RE.match(raw_line.strip())
+            if m:
+                number = int(m.group(1))
+                if number in macros:
+                    raise LayoutError(f"{where}: duplicate macro {number}")
+                macros[number] = parse_macro(m.group(2), where)
+                continue
+            m = COMBO_RE.match(line)
+            if m:
+                combos.append(parse_combo(m.group(1), m.group(2), where))
+                continue
+            if not layers:
+                raise LayoutError(f"{where}: key row outside of a layer")
+            layers[-1][1].append([parse_entry(t, where) for t in line.split()])
+
+    if not layers or layers[0][0] != 0:
+        raise LayoutError(f"{path}: layout must start with layer 0")
+    if len(layers) > 8:
+        raise LayoutError(f"{path}: at most 8 layers are supported")
+    rows = len(layers[0][1])
+    cols = len(layers[0][1][0]) if rows else 0
+    numbers = {number for number, _ in layers}
+    for number, grid in layers:
+        if len(grid) != rows or any(len(r) != cols for r in grid):
+            raise LayoutError(f"{path}: layer {number} is not {rows}x{cols}")
+        for row in grid:
+            for _, _, _, layer in row:
+                if layer is not None and layer not in numbers:
+                    raise LayoutError(f"{path}: layer {layer} is not defined")
+    if len(combos) > 32:
+        raise LayoutError(f"{path}: at most 32 combos are supported")
+    for coords, _ in combos:
+        if any(row >= rows or col >= cols for row, col in coords):
+            raise LayoutError(f"{path}: combo key {coords} out of range")
+    masks = [combo_mask(coords, rows) for coords, _ in combos]
+    if len(set(masks)) != len(masks):
+        raise LayoutError(f"{path}: duplicate combo")
+    if sorted(macros) != list(range(len(macros))):
+        raise LayoutError(f"{path}: macros must be numbered 0..{len(macros) - 1}")
+    for number, grid in layers:
+        for row in grid:
+            for key, _, action, _ in row:
+                if action == "ACTION_MACRO" and key not in macros:
+                    raise LayoutError(f"{path}: macro {key} is not defined")
+    macros = [macros[i] for i in range(len(macros))]
+    return layers, combos, macros, rows, cols
+
+
+def parse_macro(text, where):
+    """A macro is a sequence of "strings" and keys, each tapped in order."""
+    steps = []
+    for m in MACRO_TOKEN_RE.finditer(text):
+        string, token = m.groups()
+        if token is not None and token.startswith("#"):
+            break  # comment
+        if token is not None:
+            steps.append(parse_key(token, where))
+            continue
+        string = string.encode().decode("unicode_escape")
+        for c in string:
+            if c not in ASCII_KEYS:
+                raise LayoutError(f"{where}: can't type {c!r} in a macro")
+            key, shifted = ASCII_KEYS[c]
+            steps.append(parse_key(f"LSHIFT+{key}" if shifted else key, where))
+    if not steps:
+        raise LayoutError(f"{where}: empty macro")
+    return steps
+
+
+def parse_combo(coords, token, where):
+    try:
+        coords = [tuple(int(x) for x in c.split(",")) for c in coords.split()]
+    except ValueError:
+        raise LayoutError(f"{where}: bad combo keys")
+    if any(len(c) != 2 for c in coords) or len(set(coords)) < 2:
+        raise LayoutError(f"{where}: a combo needs at least two ROW,COL keys")
+    entry = parse_key(token, where)
+    return (coords, entry)
+
+
+def combo_mask(coords, rows):
+    mask = [0] * rows
+    for row, col in coords:
+        mask[row] |= 1 << col
+    return tuple(mask)
+
+
+def format_mask(mask):
+    return "{" + ", ".join(f"0x{m:03x}" for m in mask) + "}"
+
+
+def resolve(layers):
+    """Return the per-layer grids with the layer 0 fallback applied."""
+    base = layers[0][1]
+    return [
+        [
+            [entry if entry != NO_KEY else base[r][c] for c, entry in enumerate(row)]
+            for r, row in enumerate(grid)
+        ]
+        for _, grid in layers
+    ]
+
+
+def swap_ctrl_cmd(entry):
+    """Swap the LEFTCTRL and LEFTMETA keys, keeping their extra modifiers.
+
+    Modifiers of other keys (LCTRL+C, MT(LCTRL,A)) are left alone."""
+    key, mods, action, layer = entry
+    if key not in CTRL_CMD_SWAP or action is not None:
+        return entry
+    swapped = CTRL_CMD_SWAP[key]
+    mods = [m for m in mods if m != MODIFIER_KEYS[key]]
+    if MODIFIER_KEYS[swapped] not in mods:
+        mods.append(MODIFIER_KEYS[swapped])
+    return (swapped, tuple(mods), action, layer)
+
+
+def format_entry(entry):
+    key, mods, action, layer = entry
+    key = f"KEY_{key}" if key else "0"
+    mask = " | ".join(MODIFIERS[m] for m in mods) if mods else "0"
+    if action == "ACTION_MACRO":
+        return f"{{{entry[0]}, 0, {action}}}"
+    if action == "ACTION_MOD_TAP":
+        return f"{{{key}, {mask}, {action}}}"
+    if action:
+        return f"{{{key}, {mask}, {action}, LAYER_{layer}}}"
+    if key == "0":
+        return "{0, 0}"
+    return f"{{{key}, {mask}}}"
+
+
+def generate(layers, combos, macros, rows, cols, source):
+    # only layer 0 is swapped, the other layers see it through the fallback
+    number, base = layers[0]
+    swapped = [(number, [[swap_ctrl_cmd(e) for e in row] for row in base])]
+    variants = [
+        ("default", resolve(layers)),
+        ("ctrl/cmd swapped", resolve(swapped + layers[1:])),
+    ]
+    out = []
+    out.append(f"// generated by gen_keymap.py from {source}, do not edit")
+    out.append("#ifndef KEYMAP_TABLE_H")
+    out.append("#define KEYMAP_TABLE_H")
+    out.append("")
+    out.append(f"#define KEYMAP_ROWS {rows}")
+    out.append(f"#define KEYMAP_COLS {cols}")
+    out.append(f"#define KEYMAP_N_LAYERS {len(layers)}")
+    out.append(f"#define KEYMAP_N_COMBOS {len(combos)}")
+    max_keys = max([len(coords) for coords, _ in combos], default=2)
+    out.append(f"#define KEYMAP_COMBO_MAX_KEYS {max_keys}")
+    out.append(f"#define KEYMAP_N_MACROS {len(macros)}")
+    out.append("")
+    out.append("// in layout order, if several layers are active the last one wins")
+    out.append("enum key_layer {")
+    for number, _ in layers:
+        out.append(f"  LAYER_{number},")
+    out.append("};")
+    out.append("")
+    out.append("// [ctrl_cmd_swapped][layer][row][col], layer 0 fallback resolved")
+    out.append("static const struct key_action")
+    out.append("    key_map[2][KEYMAP_N_LAYERS][KEYMAP_ROWS][KEYMAP_COLS] = {")
+    for name, grids in variants:
+        out.append(f"        // {name}")
+        out.append("        {")
+        for (number, _), grid in zip(layers, grids):
+            out.append(f"            // layer {number}")
+            out.append("            {")
+            for row in grid:
+                out.append(
+                    "                {" + ", ".join(format_entry(e) for e in row) + "},"
+                )
+            out.append("            },")
+        out.append("        },")
+    out.append("};")
+    out.append("")
+    out.append("// [ctrl_cmd_swapped][combo]")
+    out.append("static const struct combo combos[2][MAX(KEYMAP_N_COMBOS, 1)] = {")
+    for name, swap in (("default", False), ("ctrl/cmd swapped", True)):
+        out.append(f"    // {name}")
+        out.append("    {")
+        for coords, entry in combos:
+            entry = swap_ctrl_cmd(entry) if swap else entry
+            mask = format_mask(combo_mask(coords, rows))
+            out.append(f"        {{{mask}, {format_entry(entry)}}},")
+        if not combos:
+            out.append("        {{0}, {0, 0}},  // unused, C has no empty arrays")
+        out.append("    },")
+    out.append("};")
+    out.append("")
+    out.append("// keys tapped by the macros")
+    for variant, swap in ((0, False), (1, True)):
+        for i, steps in enumerate(macros):
+            steps = [swap_ctrl_cmd(e) if swap else e for e in steps]
+            out.append(f"static const struct macro_step macro_{variant}_{i}[] = {{")
+            for j in range(0, len(steps), 6):
+                line = ", ".join(format_entry(e) for e in steps[j : j + 6])
+                out.append(f"    {line},")
+            out.append("};")
+    out.append("")
+    out.append("// [ctrl_cmd_swapped][macro]")
+    out.append("static const struct macro macros[2][MAX(KEYMAP_N_MACROS, 1)] = {")
+    for variant in (0, 1):
+        out.append("    {")
+        for i, steps in enumerate(macros):
+            out.append(f"        {{macro_{variant}_{i}, {len(steps)}}},")
+        if not macros:
+            out.append("        {NULL, 0},  // unused, C has no empty arrays")
+        out.append("    },")
+    out.append("};")
+    out.append("")
+    out.append("// keys that are part of any combo")
+    all_keys = combo_mask([c for coords, _ in combos for c in coords], rows)
+    out.append(
+        f"static const matrix_row_t combo_keys[KEYMAP_ROWS] = {format_mask(all_keys)};"
+    )
+    out.append("")
+    out.append("#endif  // KEYMAP_TABLE_H")
+    return "\n".join(out) + "\n"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("layout", help="layout description (layout.keymap)")
+    parser.add_argument("output", help="generated header")
+    args = parser.parse_args()
+    try:
+        layers, combos, macros, rows, cols = parse_layout(args.layout)
+    except LayoutError as e:
+        sys.exit(f"error: {e}")
+    source = args.layout.split("/")[-1]
+    header = generate(layers, combos, macros, rows, cols, source)
+    with open(args.output, "w") as f:
+        f.write(header)
+
+
+if __name__ == "__main__":
+    main()
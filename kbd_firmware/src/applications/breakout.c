@@ -27,12 +27,10 @@
 #define paddle_width 25
 #define paddle_height 3
 #define paddle_speed 3.5f
+#define frame_ms 16
 
 typedef struct {
   Vec pos, v;
-  // for partial display updates
-  // tline means topmost display line intersecting the ball
-  uint8_t prev_x, prev_tline;
 } Ball;
 
 typedef struct {
@@ -76,28 +74,6 @@ static void draw_blocks(uint8_t *block_status) {
   }
 }
 
-static void display_block(uint8_t block_id) {
-  struct BlockCoords coords = calc_block_coords(block_id);
-  lcd_display_block(coords.x1, coords.y1 / 8, 20);
-  if (coords.y2 / 8 != coords.y1 / 8) {
-    lcd_display_block(coords.x1, coords.y2 / 8, 20);
-  }
-};
-
-static void display_ball(Ball *ball) {
-  // updating only one line when the ball lies completely on one
-  // would be faster, but unless updates are changed to use timer interrupts
-  // need to do same every frame to keep frametimes consistent
-
-  uint8_t current_tline = (roundf(ball->pos.y) - ball_int_radius) / 8;
-
-  lcd_display_block(roundf(ball->pos.x) - ball_int_radius, current_tline, 5);
-  lcd_display_block(roundf(ball->pos.x) - ball_int_radius, current_tline + 1,
-                    5);
-  lcd_display_block(ball->prev_x - ball_int_radius, ball->prev_tline, 5);
-  lcd_display_block(ball->prev_x - ball_int_radius, ball->prev_tline + 1, 5);
-}
-
 static void draw_ball(Ball *ball) {
   // lcd_fillCircle(round(ball->pos.x), round(ball->pos.y), 2, 1);
   uint8_t x = roundf(ball->pos.x);
@@ -206,8 +182,6 @@ static void handle_collisions(Ball *ball, uint8_t *block_status,
 }
 
 static void move_ball(Ball *ball) {
-  ball->prev_x = roundf(ball->pos.x);
-  ball->prev_tline = (roundf(ball->pos.y) - ball_int_radius) / 8;
   ball->pos.x += ball->v.x;
   ball->pos.y += ball->v.y;
 }
@@ -217,13 +191,6 @@ static void draw_paddle(float paddle_x) {
   lcd_fillRect(xmin, DISPLAY_HEIGHT - 1 - paddle_height, xmin + paddle_width,
                DISPLAY_HEIGHT - 1, 1);
 }
-static void display_paddle(float paddle_x) {
-  uint8_t xmin = roundf(paddle_x) - (paddle_width - 1) / 2;
-  lcd_display_block(xmin < ceil8(paddle_speed) ? 0 : xmin - ceil8(paddle_speed),
-                    DISPLAY_HEIGHT / 8 - 1,
-                    paddle_width + 1 + 2 * ceil8(paddle_speed));
-}
-
 static BreakoutGamestate init_gamestate() {
   Ball ball = {.pos = {DISPLAY_WIDTH / 2, (DISPLAY_HEIGHT - 6)},
                .v = {initial_ball_vx, initial_ball_vy}};
@@ -248,6 +215,9 @@ void run_breakout() {
   lcd_display();
   wait_for_wake_release();
 
+  // only the changes are sent, in the background, so frames take the same
+  // time no matter what moved
+  int64_t next_frame_ms = k_uptime_get();
   while (1) {
     lcd_clear_buffer();
     enum AppKey key = read_key();
@@ -271,12 +241,9 @@ void run_breakout() {
     draw_blocks(state.block_status);
     draw_ball(&state.ball);
     draw_paddle(state.paddle_x);
-    display_ball(&state.ball);
-    display_paddle(state.paddle_x);
     for (uint8_t i = 0; i < num_blocks; i++) {
       if (get_block_status(i, state.block_status) !=
           get_block_status(i, state.prev_block_status)) {
-        display_block(i);
         // increase ball speed for each block hit
         state.ball.v.x *= ball_speed_increase_factor;
         state.ball.v.y *= ball_speed_increase_factor;
@@ -295,10 +262,15 @@ void run_breakout() {
           lcd_clrscr();
           draw_blocks(state.block_status);
           lcd_display();
+          next_frame_ms = k_uptime_get();
         }
       }
     }
-    k_msleep(16);
+    // if the last frame is still being sent this one is dropped, its changes
+    // are sent with the next one
+    lcd_display_async();
+    next_frame_ms = MAX(next_frame_ms + frame_ms, k_uptime_get());
+    k_sleep(K_TIMEOUT_ABS_MS(next_frame_ms));
     memcpy(state.prev_block_status, state.block_status,
            sizeof(state.prev_block_status));
   }
@@ -80,6 +80,7 @@ static void move_up(struct ScreenLoc *screen) {
     memcpy(displayBuffer[line], displayBuffer[line - 2], DISPLAY_WIDTH);
   }
   memset(displayBuffer, 0, 2 * DISPLAY_WIDTH);
+  lcd_mark_dirty(0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT / 8);
   lcd_display();
   display_mandelbrot_block(screen, 0, DISPLAY_WIDTH - 1, 1);
   display_mandelbrot_block(screen, 0, DISPLAY_WIDTH - 1, 0);
@@ -92,6 +93,7 @@ static void move_down(struct ScreenLoc *screen) {
     memcpy(displayBuffer[line], displayBuffer[line + 2], DISPLAY_WIDTH);
   }
   memset(displayBuffer[DISPLAY_HEIGHT / 8 - 2], 0, 2 * DISPLAY_WIDTH);
+  lcd_mark_dirty(0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT / 8);
   lcd_display();
   display_mandelbrot_block(screen, 0, DISPLAY_WIDTH - 1,
                            DISPLAY_HEIGHT / 8 - 2);
@@ -106,6 +108,7 @@ static void move_left(struct ScreenLoc *screen) {
     memmove(displayBuffer[line] + 32, displayBuffer[line], DISPLAY_WIDTH - 32);
     memset(displayBuffer[line], 0, 32);
   }
+  lcd_mark_dirty(0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT / 8);
   lcd_display();
   for (uint8_t line = 0; line < DISPLAY_HEIGHT / 8; line++) {
     display_mandelbrot_block(screen, 0, 32, line);
@@ -119,6 +122,7 @@ static void move_right(struct ScreenLoc *screen) {
     memmove(displayBuffer[line], displayBuffer[line] + 32, DISPLAY_WIDTH - 32);
     memset(displayBuffer[line] + (DISPLAY_WIDTH - 32), 0, 32);
   }
+  lcd_mark_dirty(0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT / 8);
   lcd_display();
   for (uint8_t line = 0; line < DISPLAY_HEIGHT / 8; line++) {
     display_mandelbrot_block(screen, DISPLAY_WIDTH - 33, DISPLAY_WIDTH - 1,
@@ -139,7 +143,7 @@ void run_mandelbrot() {
       case APP_KEY_SELECT:
         screen.scale *= 2;
         display_complete_mandelbrot(&screen);
-        while (current_pressed_keys.n_pressed > 0) {
+        while (any_key_pressed(&current_pressed_keys)) {
           k_msleep(10);
         }
         k_msleep(100);
@@ -147,7 +151,7 @@ void run_mandelbrot() {
       case APP_KEY_BACK:
         screen.scale /= 2;
         display_complete_mandelbrot(&screen);
-        while (current_pressed_keys.n_pressed > 0) {
+        while (any_key_pressed(&current_pressed_keys)) {
           k_msleep(10);
         }
         k_msleep(100);
@@ -110,7 +110,7 @@ static void roll_food_position(SnakeGamestate *gs) {
 }
 
 static void reset_snake(SnakeGamestate *gs) {
-  last_pressed_keys = (struct pressed_keys){0};
+  reset_app_keys();
   gs->length = 1;
   gs->head_x = 0;
   gs->head_y = 0;
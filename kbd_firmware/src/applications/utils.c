@@ -3,6 +3,7 @@
 #include <zephyr/kernel.h>
 
 #include "../display.h"
+#include "../key_events.h"
 
 void wait_for_wake_release() {
   while (wake_pressed()) {
@@ -16,36 +17,83 @@ void wait_for_wake() {
   }
 }
 
-enum AppKey translate_pressed_keys(struct pressed_keys pressed) {
-  if (pressed.n_pressed == 0 && !pressed.wake_pressed) {
-    return APP_KEY_NONE;
-  } else if (pressed.wake_pressed) {
+static enum AppKey translate_key(struct key_coord key) {
+  if (is_wake_key(key)) {
     return APP_KEY_EXIT;
-  } else if (pressed.keys[0].row == 1 && pressed.keys[0].col == 2) {
+  } else if (key.row == 1 && key.col == 2) {
     return APP_KEY_SELECT;
-  } else if (pressed.keys[0].row == 0 && pressed.keys[0].col == 1) {
+  } else if (key.row == 0 && key.col == 1) {
     return APP_KEY_BACK;
-  } else if (pressed.keys[0].row == 1 && pressed.keys[0].col == 1) {
+  } else if (key.row == 1 && key.col == 1) {
     return APP_KEY_LEFT;
-  } else if (pressed.keys[0].row == 1 && pressed.keys[0].col == 3) {
+  } else if (key.row == 1 && key.col == 3) {
     return APP_KEY_RIGHT;
-  } else if (pressed.keys[0].row == 0 && pressed.keys[0].col == 2) {
+  } else if (key.row == 0 && key.col == 2) {
     return APP_KEY_UP;
-  } else if (pressed.keys[0].row == 2 && pressed.keys[0].col == 2) {
+  } else if (key.row == 2 && key.col == 2) {
     return APP_KEY_DOWN;
   } else {
     return APP_KEY_NONE;
   }
 }
 
-enum AppKey read_key() { return translate_pressed_keys(current_pressed_keys); }
+enum AppKey translate_pressed_keys(struct pressed_keys pressed) {
+  struct key_coord key;
+  if (pressed.wake_pressed) {
+    return APP_KEY_EXIT;
+  } else if (first_pressed_key(&pressed, &key)) {
+    return translate_key(key);
+  }
+  return APP_KEY_NONE;
+}
 
-enum AppKey read_last_key() {
-  if (current_pressed_keys.n_pressed > 0 || current_pressed_keys.wake_pressed) {
-    return translate_pressed_keys(last_pressed_keys);
-  } else {
-    return translate_pressed_keys(last_pressed_keys);
+// applications read keys from their own position in the key event ring, so
+// a key tapped between two reads isn't lost
+static struct key_event_reader app_reader;
+static struct pressed_keys app_keys;
+// key pressed (and maybe released again) since the last read_key
+static enum AppKey app_unread_key;
+static enum AppKey app_tapped_key;
+// latest key press since the last read_last_key
+static enum AppKey app_last_pressed_key;
+
+void reset_app_keys() {
+  key_event_reader_init(&app_reader, &app_keys);
+  app_unread_key = APP_KEY_NONE;
+  app_tapped_key = APP_KEY_NONE;
+  app_last_pressed_key = APP_KEY_NONE;
+}
+
+static void update_app_keys() {
+  struct key_event event;
+  while (key_event_read(&app_reader, &event) == 0) {
+    apply_key_event(&app_keys, event);
+    enum AppKey key = translate_key(event.coord);
+    if (event.pressed) {
+      app_last_pressed_key = key;
+      app_unread_key = key;
+    } else if (key == app_unread_key) {
+      app_tapped_key = key;
+    }
+  }
+}
+
+enum AppKey read_key() {
+  update_app_keys();
+  enum AppKey key = translate_pressed_keys(app_keys);
+  if (key == APP_KEY_NONE) {
+    key = app_tapped_key;
   }
+  app_unread_key = APP_KEY_NONE;
+  app_tapped_key = APP_KEY_NONE;
+  return key;
+}
+
+enum AppKey read_last_key() {
+  update_app_keys();
+  enum AppKey key = app_last_pressed_key;
+  app_last_pressed_key = APP_KEY_NONE;
+  return key;
 }
 
 uint8_t randint(uint8_t min, uint8_t max) {
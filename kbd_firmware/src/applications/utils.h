@@ -19,8 +19,13 @@ enum AppKey {
   APP_KEY_EXIT,
 };
 
+// start reading keys from now on, called when an application starts
+void reset_app_keys();
+
+// key currently held, or a key tapped since the last call
 enum AppKey read_key();
 
+// latest key pressed since the last call
 enum AppKey read_last_key();
 
 typedef struct {
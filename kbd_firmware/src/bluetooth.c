@@ -22,9 +22,13 @@
 #include <zephyr/types.h>
 
 #include "config.h"
+#include "conn_params.h"
+#include "key_events.h"
 #include "key_layout.h"
 #include "leds.h"
+#include "nvs.h"
 #include "ui.h"
+#include "usb_hid_keys.h"
 
 #define DEVICE_NAME CONFIG_BT_DEVICE_NAME
 #define DEVICE_NAME_LEN (sizeof(DEVICE_NAME) - 1)
@@ -33,15 +37,16 @@
 
 #define OUTPUT_REPORT_MAX_LEN 1
 #define OUTPUT_REPORT_BIT_MASK_CAPS_LOCK 0x02
-#define INPUT_REP_KEYS_REF_ID 0
-#define OUTPUT_REP_KEYS_REF_ID 0
+#define INPUT_REP_KEYS_REF_ID 1
+#define INPUT_REP_NKRO_REF_ID 2
+#define OUTPUT_REP_KEYS_REF_ID 1
 #define MODIFIER_KEY_POS 0
 #define SHIFT_KEY_CODE 0x02
 #define SCAN_CODE_POS 2
 #define KEYS_MAX_LEN (INPUT_REPORT_KEYS_MAX_LEN - SCAN_CODE_POS)
 
-/* HIDs queue elements. */
-#define HIDS_QUEUE_SIZE 10
+/* HIDs queue elements, enough for every report of one key event. */
+#define HIDS_QUEUE_SIZE KEY_REPORT_BURST
 
 /* ********************* */
 /* Buttons configuration */
@@ -68,9 +73,21 @@
  */
 #define INPUT_REPORT_KEYS_MAX_LEN (1 + 1 + KEY_PRESS_MAX)
 
+/* Number of bytes in NKRO key report
+ *
+ * 1B - control keys
+ * rest - one bit per key code below NKRO_N_USAGES
+ */
+#define INPUT_REPORT_NKRO_LEN (1 + NKRO_BITMAP_BYTES)
+BUILD_ASSERT(NKRO_N_USAGES % 8 == 0 && NKRO_N_USAGES <= 0x100);
+
 /* Current report map construction requires exactly 8 buttons */
 BUILD_ASSERT((KEY_CTRL_CODE_MAX - KEY_CTRL_CODE_MIN) + 1 == 8);
 
+/* Every host slot has its own identity and bond */
+BUILD_ASSERT(N_HOST_SLOTS <= CONFIG_BT_ID_MAX &&
+             N_HOST_SLOTS <= CONFIG_BT_MAX_PAIRED);
+
 /* OUT report internal indexes.
  *
  * This is a position in internal report table and is not related to
@@ -83,62 +100,223 @@ enum { OUTPUT_REP_KEYS_IDX = 0 };
  * This is a position in internal report table and is not related to
  * report ID.
  */
-enum { INPUT_REP_KEYS_IDX = 0 };
+enum { INPUT_REP_KEYS_IDX = 0, INPUT_REP_NKRO_IDX };
 
 /* HIDS instance. */
-BT_HIDS_DEF(hids_obj, OUTPUT_REPORT_MAX_LEN, INPUT_REPORT_KEYS_MAX_LEN);
+BT_HIDS_DEF(hids_obj, OUTPUT_REPORT_MAX_LEN, INPUT_REPORT_KEYS_MAX_LEN,
+            INPUT_REPORT_NKRO_LEN);
 
 static volatile bool is_adv;
 static volatile bool waiting_for_passkey_confirmation = false;
+// the host selected the boot protocol, it only reads the boot keyboard report
+static volatile bool boot_protocol = false;
+static volatile bool link_encrypted = false;
+
+// advertising data, shared by legacy and extended advertising
+#define AD_FIELDS                                                           \
+  BT_DATA_BYTES(BT_DATA_GAP_APPEARANCE,                                     \
+                (CONFIG_BT_DEVICE_APPEARANCE >> 0) & 0xff,                  \
+                (CONFIG_BT_DEVICE_APPEARANCE >> 8) & 0xff),                 \
+      BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)), \
+      BT_DATA_BYTES(BT_DATA_UUID16_ALL,                                     \
+                    BT_UUID_16_ENCODE(BT_UUID_HIDS_VAL),                    \
+                    BT_UUID_16_ENCODE(BT_UUID_BAS_VAL))
+
+static const struct bt_data ad[] = {AD_FIELDS};
 
-static const struct bt_data ad[] = {
-    BT_DATA_BYTES(BT_DATA_GAP_APPEARANCE,
-                  (CONFIG_BT_DEVICE_APPEARANCE >> 0) & 0xff,
-                  (CONFIG_BT_DEVICE_APPEARANCE >> 8) & 0xff),
-    BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
-    BT_DATA_BYTES(BT_DATA_UUID16_ALL, BT_UUID_16_ENCODE(BT_UUID_HIDS_VAL),
-                  BT_UUID_16_ENCODE(BT_UUID_BAS_VAL)),
+static const struct bt_data sd[] = {
+    BT_DATA(BT_DATA_NAME_COMPLETE, DEVICE_NAME, DEVICE_NAME_LEN),
 };
 
-static const struct bt_data sd[] = {
+// connectable extended advertising can't be scanned, it carries the name
+static const struct bt_data ad_ext[] = {
+    AD_FIELDS,
     BT_DATA(BT_DATA_NAME_COMPLETE, DEVICE_NAME, DEVICE_NAME_LEN),
 };
 
 static struct bt_conn *current_conn = NULL;
+// connection interval of current_conn, 0 if not connected
+static uint32_t conn_interval_us = 0;
+
+// Reconnect strategy, each phase runs until it times out or a host connects.
+enum adv_phase {
+  ADV_PHASE_DIRECTED_HIGH,  // to the last host, stopped by the controller
+  ADV_PHASE_DIRECTED_LOW,   // to the last host
+  ADV_PHASE_ACCEPT_LIST,    // only bonded hosts can connect
+  ADV_PHASE_OPEN,           // any host can connect and pair
+  __ADV_N_PHASES,
+};
 
-static struct k_work adv_work;
+static const char *const adv_phase_names[__ADV_N_PHASES] = {
+    "direct", "direct low", "bonded", "open"};
 
-struct addr get_current_addr() {
-  struct addr addr;
-  if (current_conn) {
-    bt_addr_le_to_str(bt_conn_get_dst(current_conn), addr.addr,
-                      sizeof(addr.addr));
+enum adv_tier {
+  ADV_TIER_FAST,
+  ADV_TIER_SLOW,
+  __ADV_N_TIERS,
+};
+
+static const char *const adv_tier_names[__ADV_N_TIERS] = {"fast", "slow"};
+
+static const uint16_t adv_tier_intervals[__ADV_N_TIERS][2] = {
+    [ADV_TIER_FAST] = {BT_GAP_ADV_FAST_INT_MIN_2, BT_GAP_ADV_FAST_INT_MAX_2},
+    [ADV_TIER_SLOW] = {ADV_SLOW_INTERVAL_MIN, ADV_SLOW_INTERVAL_MAX},
+};
+
+static enum adv_phase adv_phase = ADV_PHASE_OPEN;
+static enum adv_tier adv_tier = ADV_TIER_FAST;
+// when the phase times out, INT64_MAX if it doesn't
+static int64_t adv_phase_end_ms = 0;
+// undirected advertising turns slow after this
+static int64_t adv_fast_until_ms = 0;
+// start again with the first phase instead of the next one
+static bool adv_restart = false;
+// wake + P, advertise to any host until one connected
+static volatile bool adv_open_requested = false;
+// the selected host slot, also the identity its host is bonded with
+static uint8_t host_slot = BT_ID_DEFAULT;
+// the host of the slot that connected last
+static bt_addr_le_t last_peer;
+static bool has_last_peer = false;
+
+// uptime of the wake (0) or the disconnect the reconnect started with
+static uint32_t reconnect_start_ms = 0;
+static bool reconnect_report_pending = true;
+struct reconnect_stats reconnect_stats = {0};
+struct adv_stats adv_stats = {0};
+
+static void adv_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(adv_work, adv_work_handler);
+
+static void flush_hid_queue(void);
+
+static void advertising_start(void) {
+  adv_restart = true;
+  k_work_reschedule(&adv_work, K_NO_WAIT);
+}
+
+struct bonds {
+  uint8_t n;
+  bool last_peer_bonded;
+};
+
+static void add_bond(const struct bt_bond_info *info, void *user_data) {
+  struct bonds *bonds = user_data;
+  int err = bt_le_filter_accept_list_add(&info->addr);
+  if (err) {
+    printk("Failed to add bond to the accept list (err %d)\n", err);
   }
-  return addr;
+  bonds->n++;
+  if (has_last_peer && bt_addr_le_eq(&info->addr, &last_peer)) {
+    bonds->last_peer_bonded = true;
+  }
+}
+
+// fills the filter accept list with the hosts bonded to the slot
+static enum adv_phase first_adv_phase(void) {
+  struct bonds bonds = {0};
+  bt_le_filter_accept_list_clear();
+  bt_foreach_bond(host_slot, add_bond, &bonds);
+  if (adv_open_requested || bonds.n == 0) {
+    return ADV_PHASE_OPEN;
+  }
+  return bonds.last_peer_bonded ? ADV_PHASE_DIRECTED_HIGH
+                                : ADV_PHASE_ACCEPT_LIST;
+}
+
+static int start_adv_phase(uint32_t *duration_ms) {
+  *duration_ms = 0;
+  const uint16_t *interval = adv_tier_intervals[adv_tier];
+  struct bt_le_adv_param param = BT_LE_ADV_PARAM_INIT(
+      BT_LE_ADV_OPT_CONN, interval[0], interval[1], NULL);
+  param.id = host_slot;
+  switch (adv_phase) {
+    case ADV_PHASE_DIRECTED_HIGH:
+      // the controller gives up after 1.28s, see connected()
+      param.interval_min = 0;
+      param.interval_max = 0;
+      param.peer = &last_peer;
+      return bt_le_adv_start(&param, NULL, 0, NULL, 0);
+    case ADV_PHASE_DIRECTED_LOW:
+      *duration_ms = ADV_DIRECTED_LOW_MS;
+      param.options |= BT_LE_ADV_OPT_DIR_MODE_LOW_DUTY;
+      param.peer = &last_peer;
+      return bt_le_adv_start(&param, NULL, 0, NULL, 0);
+    case ADV_PHASE_ACCEPT_LIST:
+      *duration_ms = ADV_ACCEPT_LIST_MS;
+      param.options |= BT_LE_ADV_OPT_FILTER_CONN;
+      break;
+    default:
+      break;
+  }
+  if (ADV_EXT_OPTIONS) {
+    param.options |= ADV_EXT_OPTIONS;
+    return bt_le_adv_start(&param, ad_ext, ARRAY_SIZE(ad_ext), NULL, 0);
+  }
+  if (adv_phase == ADV_PHASE_ACCEPT_LIST) {
+    param.options |= BT_LE_ADV_OPT_FILTER_SCAN_REQ;
+  }
+  return bt_le_adv_start(&param, ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
 }
 
-static void advertising_start(void) { k_work_submit(&adv_work); }
+// average current of undirected advertising in a tier, assuming the
+// interval is halfway between min and max, plus the random delay of 5ms
+static uint16_t adv_current_ua(enum adv_tier tier) {
+  const uint16_t *interval = adv_tier_intervals[tier];
+  uint32_t interval_ms = (interval[0] + interval[1]) * 5 / 16 + 5;
+  return ADV_EVENT_CHARGE_NC / interval_ms;
+}
 
+// Starts the first phase, moves on to the next one once the current one
+// timed out, or restarts the current one in the slow tier.
 static void adv_work_handler(struct k_work *work) {
-  int err;
-  const struct bt_le_adv_param *adv_param =
-      BT_LE_ADV_PARAM(BT_LE_ADV_OPT_CONN, BT_GAP_ADV_FAST_INT_MIN_2,
-                      BT_GAP_ADV_FAST_INT_MAX_2, NULL);
+  bt_le_adv_stop();
+  if (current_conn) {
+    return;
+  }
+  int64_t now_ms = k_uptime_get();
+  bool new_phase = true;
+  if (adv_restart) {
+    adv_restart = false;
+    adv_phase = first_adv_phase();
+    adv_fast_until_ms = now_ms + ADV_FAST_MS;
+  } else if (now_ms >= adv_phase_end_ms && adv_phase < ADV_PHASE_OPEN) {
+    adv_phase++;
+  } else {
+    new_phase = false;
+  }
+  bool directed = adv_phase < ADV_PHASE_ACCEPT_LIST;
+  adv_tier = !directed && now_ms >= adv_fast_until_ms ? ADV_TIER_SLOW
+                                                      : ADV_TIER_FAST;
 
-  err = bt_le_adv_start(adv_param, ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
+  uint32_t duration_ms;
+  int err = start_adv_phase(&duration_ms);
   if (err) {
-    if (err == -EALREADY) {
-      printk("Advertising continued\n");
-    } else {
-      printk("Advertising failed to start (err %d)\n", err);
+    printk("Advertising (%s) failed to start (err %d)\n",
+           adv_phase_names[adv_phase], err);
+    adv_phase_end_ms = 0;
+    if (adv_phase < ADV_PHASE_OPEN) {
+      k_work_reschedule(&adv_work, K_NO_WAIT);
     }
-
     return;
   }
+  if (new_phase) {
+    adv_phase_end_ms = duration_ms ? now_ms + duration_ms : INT64_MAX;
+  }
+  int64_t next_ms = adv_phase_end_ms;
+  if (!directed && adv_tier == ADV_TIER_FAST) {
+    next_ms = MIN(next_ms, adv_fast_until_ms);
+  }
+  if (next_ms != INT64_MAX) {
+    k_work_reschedule(&adv_work, K_MSEC(next_ms - now_ms));
+  }
 
   is_adv = true;
+  adv_stats.tier = directed ? adv_phase_names[adv_phase]
+                            : adv_tier_names[adv_tier];
   led_start_advertising_anim();
-  printk("Advertising successfully started\n");
+  printk("Advertising (%s, %s) started\n", adv_phase_names[adv_phase],
+         adv_stats.tier);
 }
 
 static void connected(struct bt_conn *conn, uint8_t err) {
@@ -146,14 +324,32 @@ static void connected(struct bt_conn *conn, uint8_t err) {
 
   bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 
+  if (err == BT_HCI_ERR_ADV_TIMEOUT) {
+    // high duty directed advertising ended, go on with the next phase
+    adv_phase_end_ms = 0;
+    k_work_reschedule(&adv_work, K_NO_WAIT);
+    return;
+  }
   if (err) {
     printk("Failed to connect to %s 0x%02x %s\n", addr, err,
            bt_hci_err_to_str(err));
     return;
   }
+  struct bt_conn_info info = {.id = host_slot};
+  bt_conn_get_info(conn, &info);
+  if (info.id != host_slot) {
+    // advertising of the previous slot, disconnected() advertises again
+    printk("Connected %s on another host slot, disconnecting\n", addr);
+    bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+    return;
+  }
   current_conn = bt_conn_ref(conn);
-
-  printk("Connected %s\n", addr);
+  k_work_cancel_delayable(&adv_work);
+  adv_open_requested = false;
+  reconnect_stats.connect_ms = k_uptime_get_32() - reconnect_start_ms;
+  reconnect_stats.phase = adv_phase_names[adv_phase];
+  conn_interval_us = BT_CONN_INTERVAL_TO_US(info.le.interval);
+  printk("Connected %s, interval %dus\n", addr, conn_interval_us);
 
   err = bt_hids_connected(&hids_obj, conn);
 
@@ -163,6 +359,7 @@ static void connected(struct bt_conn *conn, uint8_t err) {
   }
 
   is_adv = false;
+  adv_stats.tier = NULL;
   led_stop_anim();
   int ret = bt_conn_set_security(conn, BT_SECURITY_L4);
   if (ret) {
@@ -173,7 +370,8 @@ static void connected(struct bt_conn *conn, uint8_t err) {
     }
   }
 
-  init_key_layout();
+  reload_key_layout();
+  conn_params_connected(conn);
 }
 
 static void disconnected(struct bt_conn *conn, uint8_t reason) {
@@ -183,6 +381,11 @@ static void disconnected(struct bt_conn *conn, uint8_t reason) {
 
   printk("Disconnected from %s, reason 0x%02x %s\n", addr, reason,
          bt_hci_err_to_str(reason));
+  if (conn != current_conn) {
+    // refused by connected(), see there
+    advertising_start();
+    return;
+  }
   int err = bt_hids_disconnected(&hids_obj, conn);
 
   if (err) {
@@ -190,9 +393,32 @@ static void disconnected(struct bt_conn *conn, uint8_t reason) {
   }
   bt_conn_unref(current_conn);
   current_conn = NULL;
+  conn_interval_us = 0;
+  boot_protocol = false;
+  flush_hid_queue();
+  conn_params_disconnected();
+  link_encrypted = false;
+  reconnect_start_ms = k_uptime_get_32();
+  reconnect_report_pending = true;
+  reconnect_stats = (struct reconnect_stats){0};
   advertising_start();
 }
 
+static void le_param_updated(struct bt_conn *conn, uint16_t interval,
+                             uint16_t latency, uint16_t timeout) {
+  conn_interval_us = BT_CONN_INTERVAL_TO_US(interval);
+  printk("Connection parameters updated: interval %dus latency %d\n",
+         conn_interval_us, latency);
+  conn_params_updated(interval, latency);
+}
+
+static void subrate_changed(struct bt_conn *conn,
+                            const struct bt_conn_le_subrate_changed *params) {
+  printk("Subrate changed: status 0x%02x factor %d continuation %d\n",
+         params->status, params->factor, params->continuation_number);
+  conn_params_subrate_changed(params->status, params->factor);
+}
+
 static void security_changed(struct bt_conn *conn, bt_security_t level,
                              enum bt_security_err err) {
   char addr[BT_ADDR_LE_STR_LEN];
@@ -201,6 +427,17 @@ static void security_changed(struct bt_conn *conn, bt_security_t level,
 
   if (!err) {
     printk("Security changed: %s level %u\n", addr, level);
+    link_encrypted = level >= BT_SECURITY_L2;
+    // recorded keys can be replayed now
+    key_event_wake();
+    const bt_addr_le_t *dst = bt_conn_get_dst(conn);
+    if (!has_last_peer || !bt_addr_le_eq(dst, &last_peer)) {
+      bt_addr_le_copy(&last_peer, dst);
+      has_last_peer = true;
+      nvs_store_slot_peer(host_slot, dst);
+      // settings of the previous host of the slot were reset
+      reload_key_layout();
+    }
   } else {
     printk("Security failed: %s level %u err %d %s\n", addr, level, err,
            bt_security_err_to_str(err));
@@ -211,6 +448,8 @@ BT_CONN_CB_DEFINE(conn_callbacks) = {
     .connected = connected,
     .disconnected = disconnected,
     .security_changed = security_changed,
+    .le_param_updated = le_param_updated,
+    .subrate_changed = subrate_changed,
 };
 
 static void auth_passkey_display(struct bt_conn *conn, unsigned int passkey) {
@@ -246,12 +485,41 @@ static void auth_cancel(struct bt_conn *conn) {
   }
 }
 
+struct other_bonds {
+  const bt_addr_le_t *keep;
+  bt_addr_le_t addrs[CONFIG_BT_MAX_PAIRED];
+  uint8_t n;
+};
+
+static void add_other_bond(const struct bt_bond_info *info, void *user_data) {
+  struct other_bonds *bonds = user_data;
+  if (!bt_addr_le_eq(&info->addr, bonds->keep) &&
+      bonds->n < ARRAY_SIZE(bonds->addrs)) {
+    bt_addr_le_copy(&bonds->addrs[bonds->n++], &info->addr);
+  }
+}
+
+// a slot keeps one host, pairing replaces the previous one
+static void forget_other_hosts(const bt_addr_le_t *keep) {
+  struct other_bonds bonds = {.keep = keep};
+  bt_foreach_bond(host_slot, add_other_bond, &bonds);
+  for (uint8_t i = 0; i < bonds.n; i++) {
+    int err = bt_unpair(host_slot, &bonds.addrs[i]);
+    if (err) {
+      printk("Failed to remove bond (err %d)\n", err);
+    }
+  }
+}
+
 static void pairing_complete(struct bt_conn *conn, bool bonded) {
   char addr[BT_ADDR_LE_STR_LEN];
 
   bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 
   printk("Pairing completed: %s, bonded: %d\n", addr, bonded);
+  if (bonded) {
+    forget_other_hosts(bt_conn_get_dst(conn));
+  }
 }
 
 static void pairing_failed(struct bt_conn *conn, enum bt_security_err reason) {
@@ -301,10 +569,53 @@ bool ble_is_advertising() { return is_adv; }
 
 bool ble_is_connected() { return current_conn != NULL; }
 
+bool ble_is_ready() { return current_conn != NULL && link_encrypted; }
+
+void ble_advertise_open() {
+  adv_open_requested = true;
+  if (current_conn) {
+    // disconnected() restarts advertising
+    bt_conn_disconnect(current_conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+    return;
+  }
+  advertising_start();
+}
+
+void ble_select_host_slot(uint8_t slot) {
+  if (slot >= N_HOST_SLOTS || (slot == host_slot && current_conn)) {
+    return;
+  }
+  printk("Switching to host slot %d\n", slot + 1);
+  host_slot = slot;
+  nvs_store_host_slot(slot);
+  has_last_peer = nvs_get_slot_peer(slot, &last_peer);
+  reload_key_layout();
+  adv_open_requested = false;
+  reconnect_start_ms = k_uptime_get_32();
+  reconnect_report_pending = true;
+  reconnect_stats = (struct reconnect_stats){0};
+  if (current_conn) {
+    // disconnected() advertises to the host of the new slot
+    bt_conn_disconnect(current_conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+    return;
+  }
+  advertising_start();
+}
+
+uint8_t ble_host_slot() { return host_slot; }
+
+uint32_t ble_conn_interval_us() { return conn_interval_us; }
+
 bool is_waiting_for_passkey_confirmation() {
   return waiting_for_passkey_confirmation;
 }
 
+static void hids_pm_evt_handler(enum bt_hids_pm_evt evt,
+                                struct bt_conn *conn) {
+  boot_protocol = evt == BT_HIDS_PM_EVT_BOOT_MODE_ENTERED;
+  printk("HID %s protocol\n", boot_protocol ? "boot" : "report");
+}
+
 static void init_hid(void) {
   int err;
   struct bt_hids_init_param hids_init_obj = {0};
@@ -342,6 +653,22 @@ static void init_hid(void) {
       0x29, 0x65, /* Usage Maximum (101) */
       0x81, 0x00, /* Input (Data, Array) Key array(6 bytes) */
 
+      /* NKRO keys */
+      0x85, INPUT_REP_NKRO_REF_ID,
+      0x05, 0x07, /* Usage Page (Key Codes) */
+      0x19, 0xe0, /* Usage Minimum (224) */
+      0x29, 0xe7, /* Usage Maximum (231) */
+      0x15, 0x00, /* Logical Minimum (0) */
+      0x25, 0x01, /* Logical Maximum (1) */
+      0x75, 0x01, /* Report Size (1) */
+      0x95, 0x08, /* Report Count (8) */
+      0x81, 0x02, /* Input (Data, Variable, Absolute) */
+
+      0x19, 0x00,              /* Usage Minimum (0) */
+      0x29, NKRO_N_USAGES - 1, /* Usage Maximum */
+      0x95, NKRO_N_USAGES,     /* Report Count */
+      0x81, 0x02, /* Input (Data, Variable, Absolute) Key bitmap */
+
   /* LED */
 #if OUTPUT_REP_KEYS_REF_ID
       0x85, OUTPUT_REP_KEYS_REF_ID,
@@ -374,6 +701,11 @@ static void init_hid(void) {
   hids_inp_rep->id = INPUT_REP_KEYS_REF_ID;
   hids_init_obj.inp_rep_group_init.cnt++;
 
+  hids_inp_rep = &hids_init_obj.inp_rep_group_init.reports[INPUT_REP_NKRO_IDX];
+  hids_inp_rep->size = INPUT_REPORT_NKRO_LEN;
+  hids_inp_rep->id = INPUT_REP_NKRO_REF_ID;
+  hids_init_obj.inp_rep_group_init.cnt++;
+
   hids_outp_rep =
       &hids_init_obj.outp_rep_group_init.reports[OUTPUT_REP_KEYS_IDX];
   hids_outp_rep->size = OUTPUT_REPORT_MAX_LEN;
@@ -381,11 +713,33 @@ static void init_hid(void) {
   hids_init_obj.outp_rep_group_init.cnt++;
 
   hids_init_obj.is_kb = true;
+  hids_init_obj.pm_evt_handler = hids_pm_evt_handler;
 
   err = bt_hids_init(&hids_obj, &hids_init_obj);
   __ASSERT(err == 0, "HIDS initialization failed\n");
 }
 
+// creates the identities of the slots that were never used
+static void init_host_slots(void) {
+  bt_addr_le_t addrs[CONFIG_BT_ID_MAX];
+  size_t n_ids = ARRAY_SIZE(addrs);
+  bt_id_get(addrs, &n_ids);
+  while (n_ids < N_HOST_SLOTS) {
+    int id = bt_id_create(NULL, NULL);
+    if (id < 0) {
+      printk("Failed to create identity (err %d)\n", id);
+      break;
+    }
+    n_ids++;
+  }
+  host_slot = nvs_get_host_slot();
+  if (host_slot >= n_ids) {
+    host_slot = BT_ID_DEFAULT;
+  }
+  has_last_peer = nvs_get_slot_peer(host_slot, &last_peer);
+  printk("Host slot %d\n", host_slot + 1);
+}
+
 int init_bluetooth(void) {
   waiting_for_passkey_confirmation = false;
   int err;
@@ -415,29 +769,275 @@ int init_bluetooth(void) {
   if (IS_ENABLED(CONFIG_SETTINGS)) {
     settings_load();
   }
+  init_host_slots();
+  adv_stats.fast_ua = adv_current_ua(ADV_TIER_FAST);
+  adv_stats.slow_ua = adv_current_ua(ADV_TIER_SLOW);
 
-  k_work_init(&adv_work, adv_work_handler);
   advertising_start();
   return 0;
 }
 
-void send_encoded_keys(struct encoded_keys keys) {
+// 6 key array report as used by the boot protocol, all key slots are
+// KEY_ERR_OVF if more keys are pressed
+static void encode_6kro(const struct encoded_keys *keys,
+                        uint8_t report[INPUT_REPORT_KEYS_MAX_LEN]) {
+  memset(report, 0, INPUT_REPORT_KEYS_MAX_LEN);
+  report[MODIFIER_KEY_POS] = keys->modifier_mask;
+  uint8_t n_keys = 0;
+  for (uint8_t i = 0; i < NKRO_BITMAP_BYTES; i++) {
+    for (uint8_t bits = keys->keys[i]; bits; bits &= bits - 1) {
+      if (n_keys == KEYS_MAX_LEN) {
+        memset(&report[SCAN_CODE_POS], KEY_ERR_OVF, KEYS_MAX_LEN);
+        return;
+      }
+      report[SCAN_CODE_POS + n_keys++] = i * 8 + __builtin_ctz(bits);
+    }
+  }
+}
+
+static int send_encoded_keys_notify(struct encoded_keys keys,
+                                    bt_gatt_complete_func_t sent) {
+  if (!current_conn) {
+    return -ENOTCONN;
+  }
+  if (HID_NKRO && !boot_protocol) {
+    /* NKRO Report:
+     * Byte 0: modifier mask
+     * Byte 1-: one bit per key code
+     */
+    uint8_t report[INPUT_REPORT_NKRO_LEN];
+    report[0] = keys.modifier_mask;
+    memcpy(&report[1], keys.keys, NKRO_BITMAP_BYTES);
+    return bt_hids_inp_rep_send(&hids_obj, current_conn, INPUT_REP_NKRO_IDX,
+                                report, sizeof(report), sent);
+  }
   /* HID Report:
    * Byte 0: modifier mask
    * Byte 1: reserved (must be 0)
    * Byte 2-7: keys (up to 6 keys)
    */
-  uint8_t report[8] = {0};
+  uint8_t report[INPUT_REPORT_KEYS_MAX_LEN];
+  encode_6kro(&keys, report);
+  if (boot_protocol) {
+    return bt_hids_boot_kb_inp_rep_send(&hids_obj, current_conn, report,
+                                        sizeof(report), sent);
+  }
+  return bt_hids_inp_rep_send(&hids_obj, current_conn, INPUT_REP_KEYS_IDX,
+                              report, sizeof(report), sent);
+}
+
+// A queued report and the callback to call once it left the queue.
+struct queued_report {
+  struct encoded_keys keys;
+  bt_gatt_complete_func_t sent;
+};
+
+// Reports are sent one at a time, the next one once the stack completed the
+// previous one. So they never pile up in the ATT TX buffers and a send that
+// found no buffer can be retried instead of being lost. One extra slot holds
+// a new report until the queue is shrunk, or a report put back after a failed
+// send.
+static struct k_spinlock hid_queue_lock;
+static struct queued_report hid_queue[HIDS_QUEUE_SIZE + 1];
+static uint8_t hid_queue_len = 0;
+static bool report_in_flight = false;
+static bt_gatt_complete_func_t in_flight_sent = NULL;
+// the last report given to the stack, the queued reports change it in order
+static struct encoded_keys last_sent = {0};
+static void report_retry_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(report_retry_work, report_retry_work_handler);
+
+struct hid_queue_stats hid_queue_stats = {0};
+
+// The changes a->b and b->c touch different keys, so going from a to c
+// directly only makes them simultaneous: no tap is lost and no release is
+// merged with a press of the same key.
+static bool can_coalesce(const struct encoded_keys *a,
+                         const struct encoded_keys *b,
+                         const struct encoded_keys *c) {
+  if ((a->modifier_mask ^ b->modifier_mask) &
+      (b->modifier_mask ^ c->modifier_mask)) {
+    return false;
+  }
+  for (uint8_t i = 0; i < NKRO_BITMAP_BYTES; i++) {
+    if ((a->keys[i] ^ b->keys[i]) & (b->keys[i] ^ c->keys[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static const struct encoded_keys *queued_before(uint8_t i) {
+  return i == 0 ? &last_sent : &hid_queue[i - 1].keys;
+}
+
+// Removes a report that isn't the newest. The next report has the full key
+// state, so it also takes over the callback.
+static void remove_queued(uint8_t i) {
+  if (!hid_queue[i + 1].sent) {
+    hid_queue[i + 1].sent = hid_queue[i].sent;
+  }
+  memmove(&hid_queue[i], &hid_queue[i + 1],
+          (hid_queue_len - i - 1) * sizeof(hid_queue[0]));
+  hid_queue_len--;
+}
+
+// Makes room for one report by coalescing two, false if every pair would
+// hide a tap. Nothing else is removed: dropping a release or merging it with
+// the next press of the key would lose keystrokes.
+static bool shrink_hid_queue(void) {
+  for (uint8_t i = 0; i + 1 < hid_queue_len; i++) {
+    if (can_coalesce(queued_before(i), &hid_queue[i].keys,
+                     &hid_queue[i + 1].keys)) {
+      remove_queued(i);
+      hid_queue_stats.n_coalesced++;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void send_next_report(void);
+
+static void report_sent(struct bt_conn *conn, void *user_data) {
+  k_spinlock_key_t key = k_spin_lock(&hid_queue_lock);
+  if (conn != current_conn || !report_in_flight) {
+    // completed after the queue was flushed on disconnect
+    k_spin_unlock(&hid_queue_lock, key);
+    return;
+  }
+  bt_gatt_complete_func_t sent = in_flight_sent;
+  report_in_flight = false;
+  in_flight_sent = NULL;
+  hid_queue_stats.n_sent++;
+  if (reconnect_report_pending) {
+    reconnect_report_pending = false;
+    reconnect_stats.first_report_ms = k_uptime_get_32() - reconnect_start_ms;
+  }
+  k_spin_unlock(&hid_queue_lock, key);
 
-  report[0] = keys.modifier_mask;
-  report[1] = 0;  // reserved byte, always 0
+  if (sent) {
+    sent(conn, user_data);
+  }
+  send_next_report();
+  if (hid_queue_depth() == 0) {
+    // the main loop replays recorded keys once the queues are empty
+    key_event_wake();
+  }
+}
 
-  for (int i = 0; i < MAX_N_ENCODED_KEYS; i++) {
-    report[i + 2] = keys.keys[i];
+static void send_next_report(void) {
+  k_spinlock_key_t key = k_spin_lock(&hid_queue_lock);
+  if (report_in_flight || hid_queue_len == 0) {
+    k_spin_unlock(&hid_queue_lock, key);
+    return;
   }
-  int ret = bt_hids_inp_rep_send(&hids_obj, current_conn, INPUT_REP_KEYS_IDX,
-                                 report, sizeof(report), NULL);
-  printk("HID report sent, ret: %d\n", ret);
+  struct queued_report report = hid_queue[0];
+  struct encoded_keys before = last_sent;
+  memmove(&hid_queue[0], &hid_queue[1],
+          (hid_queue_len - 1) * sizeof(hid_queue[0]));
+  hid_queue_len--;
+  last_sent = report.keys;
+  report_in_flight = true;
+  in_flight_sent = report.sent;
+  k_spin_unlock(&hid_queue_lock, key);
+
+  int err = send_encoded_keys_notify(report.keys, report_sent);
+  if (err == 0) {
+    return;
+  }
+
+  key = k_spin_lock(&hid_queue_lock);
+  report_in_flight = false;
+  in_flight_sent = NULL;
+  if (err == -ENOMEM) {
+    // no ATT TX buffer, put the report back and retry
+    memmove(&hid_queue[1], &hid_queue[0],
+            hid_queue_len * sizeof(hid_queue[0]));
+    hid_queue[0] = report;
+    hid_queue_len++;
+    last_sent = before;
+    if (hid_queue_len > HIDS_QUEUE_SIZE) {
+      shrink_hid_queue();
+    }
+    hid_queue_stats.n_retries++;
+    k_spin_unlock(&hid_queue_lock, key);
+    k_work_reschedule(&report_retry_work,
+                      K_USEC(MAX(conn_interval_us, USEC_PER_MSEC)));
+    return;
+  }
+  hid_queue_stats.n_dropped++;
+  last_sent = before;
+  k_spin_unlock(&hid_queue_lock, key);
+  printk("HID report failed, err %d\n", err);
+  if (report.sent) {
+    report.sent(current_conn, NULL);
+  }
+  // the reports behind it may release keys, keep draining
+  k_work_reschedule(&report_retry_work, K_NO_WAIT);
+}
+
+static void report_retry_work_handler(struct k_work *work) {
+  send_next_report();
+}
+
+// drops all queued reports, the host releases all keys on disconnect
+static void flush_hid_queue(void) {
+  struct queued_report flushed[HIDS_QUEUE_SIZE + 1];
+  k_spinlock_key_t key = k_spin_lock(&hid_queue_lock);
+  uint8_t n_flushed = hid_queue_len;
+  memcpy(flushed, hid_queue, n_flushed * sizeof(flushed[0]));
+  if (in_flight_sent) {
+    flushed[n_flushed++].sent = in_flight_sent;
+  }
+  hid_queue_len = 0;
+  report_in_flight = false;
+  in_flight_sent = NULL;
+  last_sent = (struct encoded_keys){0};
+  k_spin_unlock(&hid_queue_lock, key);
+
+  // waiters are told the reports left the queue
+  for (uint8_t i = 0; i < n_flushed; i++) {
+    if (flushed[i].sent) {
+      flushed[i].sent(NULL, NULL);
+    }
+  }
+}
+
+int queue_encoded_keys(struct encoded_keys keys,
+                       bt_gatt_complete_func_t sent) {
+  if (!current_conn) {
+    return -ENOTCONN;
+  }
+  k_spinlock_key_t key = k_spin_lock(&hid_queue_lock);
+  // over full after a report was put back
+  bool full = hid_queue_len > HIDS_QUEUE_SIZE && !shrink_hid_queue();
+  if (!full) {
+    hid_queue[hid_queue_len++] = (struct queued_report){keys, sent};
+    if (hid_queue_len > HIDS_QUEUE_SIZE && !shrink_hid_queue()) {
+      hid_queue_len--;
+      full = true;
+    }
+  }
+  if (full) {
+    hid_queue_stats.n_full++;
+    k_spin_unlock(&hid_queue_lock, key);
+    return -ENOMEM;
+  }
+  uint8_t depth = hid_queue_len + report_in_flight;
+  hid_queue_stats.max_depth = MAX(hid_queue_stats.max_depth, depth);
+  k_spin_unlock(&hid_queue_lock, key);
+
+  conn_params_activity();
+  send_next_report();
+  return 0;
+}
+
+uint8_t hid_queue_depth() {
+  k_spinlock_key_t key = k_spin_lock(&hid_queue_lock);
+  uint8_t depth = hid_queue_len + report_in_flight;
+  k_spin_unlock(&hid_queue_lock, key);
+  return depth;
 }
 
 void send_bas_soc(float soc) { bt_bas_set_battery_level((uint8_t)soc); }
@@ -4,24 +4,68 @@
 
 #include <stdbool.h>
 #include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/gatt.h>
 
 #include "config.h"
 
 bool ble_is_advertising();
 bool ble_is_connected();
+// connected and encrypted, reports reach the host
+bool ble_is_ready();
+// disconnects and advertises to any host, to pair a new one
+void ble_advertise_open();
+// switches to host slot 0..N_HOST_SLOTS-1 and reconnects to its host
+void ble_select_host_slot(uint8_t slot);
+uint8_t ble_host_slot();
+// 0 if not connected
+uint32_t ble_conn_interval_us();
 
 bool is_waiting_for_passkey_confirmation();
 void confirm_passkey();
 void reject_passkey();
 
 int init_bluetooth();
-void send_encoded_keys(struct encoded_keys keys);
 
-struct addr {
-  char addr[BT_ADDR_LE_STR_LEN];
+// Queues a report for the host, -ENOTCONN if not connected. sent is called
+// once the report was transmitted, or dropped on disconnect (conn NULL).
+// When the queue is full, reports whose changes touch different keys are
+// coalesced. If none can be, -ENOMEM: the caller keeps the report and tries
+// again later, nothing is dropped.
+int queue_encoded_keys(struct encoded_keys keys,
+                       bt_gatt_complete_func_t sent);
+// queued reports, including the one being sent
+uint8_t hid_queue_depth();
+
+struct hid_queue_stats {
+  uint32_t n_sent;
+  uint32_t n_coalesced;
+  uint32_t n_dropped;  // failed sends
+  uint32_t n_full;     // reports refused with -ENOMEM
+  uint32_t n_retries;  // sends without a free ATT TX buffer
+  uint8_t max_depth;
+};
+
+extern struct hid_queue_stats hid_queue_stats;
+
+// Times since the wake or disconnect the last reconnect started with, 0
+// while pending. Waking from deep sleep is a reset, so they include the boot.
+struct reconnect_stats {
+  uint32_t connect_ms;
+  uint32_t first_report_ms;
+  const char *phase;  // advertising phase the host connected in
+};
+
+extern struct reconnect_stats reconnect_stats;
+
+// Estimated average current of undirected advertising per interval tier.
+// The radio draws more while directed advertising (a few seconds).
+struct adv_stats {
+  const char *tier;  // NULL if not advertising
+  uint16_t fast_ua;
+  uint16_t slow_ua;
 };
 
-struct addr get_current_addr();
+extern struct adv_stats adv_stats;
 
 void send_bas_soc(float soc);
 
@@ -5,7 +5,17 @@
 #include <stdint.h>
 
 #define MAX_N_ENCODED_KEYS 6
-#define MAX_N_PRESSED_KEYS 6
+// The NKRO report has one bit per key usage below NKRO_N_USAGES. Together
+// with the modifier byte it fills a notification at the default ATT MTU (20
+// bytes), higher usages are not reported.
+#define NKRO_N_USAGES 0x98
+#define NKRO_BITMAP_BYTES (NKRO_N_USAGES / 8)
+// send the NKRO report in report protocol, else the 6 key report. The boot
+// protocol always uses the 6 key report.
+#define HID_NKRO true
+
+#define MATRIX_ROWS 4
+#define MATRIX_COLS 11
 // go to sleep if no key presses for this time
 #define DEEP_SLEEP_TIMEOUT_S 60 * 30
 // go to sleep if no key presses and keyboard is advertising
@@ -14,9 +24,124 @@
 // (to prevent battery drain if something is lying on the keyboard)
 #define DEEP_SLEEP_NO_PRESSED_TIMEOUT_S 60 * 5
 
+// Adaptive scanning: nothing held -> wait for a row interrupt. While keys
+// are held the scan period depends on the time since the last key change:
+// typing bursts are scanned every SCAN_BURST_PERIOD_MS, stepping down to
+// SCAN_SLOW_PERIOD_MS. Once the held keys are stable for SCAN_HOLD_AFTER_MS
+// (e.g. a held modifier) the scanner sleeps on row interrupts for new presses
+// and polls for releases every SCAN_BURST_PERIOD_MS. Held columns aren't
+// driven while sleeping, so a release raises no interrupt and a held
+// backspace would keep repeating on the host until the next poll.
+#define SCAN_BURST_PERIOD_MS 1
+#define SCAN_SLOW_AFTER_MS 100
+#define SCAN_SLOW_PERIOD_MS 5
+#define SCAN_HOLD_AFTER_MS 300
+// delay between driving a column and reading the rows
+#define SCAN_SETTLE_US 1
+
+// debounce algorithm, see debounce.h
+#define DEBOUNCE_MODE DEBOUNCE_EAGER_PRESS
+// a key must be stable for this long before a (deferred) change is reported
+#define DEBOUNCE_PRESS_MS 5
+#define DEBOUNCE_RELEASE_MS 5
+// Tap-hold (mod-tap & layer-tap) keys: a key held for TAPPING_TERM_MS is a
+// hold, released earlier it is a tap. With permissive hold, tapping another
+// key while it is held decides hold; with hold on other key press any other
+// press does.
+#define TAPPING_TERM_MS 200
+#define TAP_HOLD_PERMISSIVE_HOLD true
+#define TAP_HOLD_ON_OTHER_KEY_PRESS false
+// events held back while a tap-hold key is undecided, more decide hold
+#define TAP_HOLD_BUFFER_SIZE 8
+// combo keys must all be pressed within this time. A held back key is
+// released early once no combo can match any more.
+#define COMBO_TERM_MS 40
+// most keys of a combo in layout.keymap
+#define COMBO_MAX_KEYS 4
+// Most reports one key event or timeout can produce: each event held back by
+// a tap-hold key or a combo can decide a tap-hold key and report itself, plus
+// the combo.
+#define KEY_REPORT_BURST (2 * (TAP_HOLD_BUFFER_SIZE + COMBO_MAX_KEYS + 1) + 1)
+// macros and reports waiting for a playing macro
+#define MACRO_QUEUE_SIZE 16
+// main loop wakes at least this often for timeouts & battery reporting
+#define MAIN_LOOP_TIMEOUT_MS 1000
+// Key events while the host can't receive reports are recorded and replayed
+// once the link is encrypted, one event per sent report. Presses stop being
+// recorded KEY_BUFFER_RELEASE_RESERVE events before the buffer is full, and
+// are discarded once the oldest one is older than KEY_BUFFER_MAX_AGE_MS. A
+// release finding the buffer full replaces the oldest recorded press.
+#define KEY_BUFFER_SIZE 128
+#define KEY_BUFFER_RELEASE_RESERVE 16
+#define KEY_BUFFER_MAX_AGE_MS 10000
+
+// Run the display bus at fast-plus (1MHz) instead of 400kHz if it works
+// without transfer errors, checked once per boot. Needs pull-ups strong
+// enough for 1MHz, see benchmark_display() for the gain.
+#define DISPLAY_I2C_FAST_PLUS false
+
 // send state of charge once per minute
 #define BAS_SOC_INTERVAL_S 60
 
+// Reconnecting after wake or disconnect: high duty directed advertising to
+// the last host (1.28s), low duty directed advertising for
+// ADV_DIRECTED_LOW_MS, then advertising to bonded hosts only for
+// ADV_ACCEPT_LIST_MS, then to any host. wake + P opens it to any host right
+// away to pair a new one.
+#define ADV_DIRECTED_LOW_MS 3000
+#define ADV_ACCEPT_LIST_MS 30000
+// Advertising to bonded or any hosts uses the fast interval (100-150ms) for
+// ADV_FAST_MS after the reconnect started, then the slow one until deep
+// sleep. Intervals in 0.625ms units.
+#define ADV_FAST_MS 40000
+#define ADV_SLOW_INTERVAL_MIN 1600  // 1s
+#define ADV_SLOW_INTERVAL_MAX 1920  // 1.2s
+// Extended advertising: BT_LE_ADV_OPT_EXT_ADV sends the data on the 2M PHY,
+// adding BT_LE_ADV_OPT_CODED uses the coded PHY for range. Needs
+// CONFIG_BT_EXT_ADV=y and hosts that scan for it, 0 for legacy advertising.
+#define ADV_EXT_OPTIONS 0
+// charge of one legacy advertising event on three channels at 0dBm, for the
+// current estimate on the debug page
+#define ADV_EVENT_CHARGE_NC 15000
+
+// Hosts selected with wake + 1..N_HOST_SLOTS. Each slot advertises with its
+// own Bluetooth identity and keeps one bonded host and its settings, so
+// switching to a slot reconnects to its host with directed advertising.
+#define N_HOST_SLOTS 4
+
+// BLE connection parameters, intervals in 1.25ms units, timeouts in 10ms.
+// While typing the shortest interval is requested and the keyboard listens
+// to every connection event. After CONN_IDLE_AFTER_MS without reports a
+// longer interval is requested and the keyboard may skip up to
+// CONN_IDLE_LATENCY events. It can still send at every event, so the first
+// key press after idle is delayed by at most one idle interval.
+#define CONN_FAST_INTERVAL_MIN 6  // 7.5ms
+#define CONN_FAST_INTERVAL_MAX 9  // 11.25ms, the shortest some hosts accept
+#define CONN_FAST_LATENCY 0
+#define CONN_IDLE_AFTER_MS 5000
+#define CONN_IDLE_INTERVAL_MIN 24  // 30ms
+#define CONN_IDLE_INTERVAL_MAX 36  // 45ms
+#define CONN_IDLE_LATENCY 30
+#define CONN_SUPERVISION_TIMEOUT 400  // 4s
+// at most one parameter update request per this time
+#define CONN_PARAMS_MIN_REQUEST_INTERVAL_MS 1000
+// the first request after connecting, the stack holds back earlier ones
+// (CONFIG_BT_CONN_PARAM_UPDATE_TIMEOUT)
+#define CONN_PARAMS_FIRST_REQUEST_MS 5000
+// A request without a matching update within this time was rejected, as is
+// one the host answered with other parameters. Rejected parameters aren't
+// requested again for CONN_PARAMS_REJECT_BACKOFF_MS.
+#define CONN_PARAMS_RESPONSE_TIMEOUT_MS 5000
+#define CONN_PARAMS_REJECT_BACKOFF_MS 30000
+// With connection subrating (BLE 5.3) the link stays on the fast interval
+// when idle and only every CONN_SUBRATE_IDLE_FACTOR-th event is used. After
+// an event with data the next CONN_SUBRATE_CONTINUATION events are used as
+// well, so a typing burst is sent at the fast interval right away while the
+// subrating is lifted. Hosts without subrating get the idle parameters.
+#define CONN_SUBRATE_IDLE_FACTOR 8
+#define CONN_SUBRATE_IDLE_LATENCY 3  // in subrated events
+#define CONN_SUBRATE_CONTINUATION 20
+
 struct key_coord {
   uint8_t row;
   uint8_t col;
@@ -26,17 +151,43 @@ inline bool keq(struct key_coord a, struct key_coord b) {
   return a.row == b.row && a.col == b.col;
 }
 
+// one bit per column
+typedef uint16_t matrix_row_t;
+
 // physical keys pressed
 struct pressed_keys {
   bool wake_pressed;
-  struct key_coord keys[MAX_N_PRESSED_KEYS];
-  uint8_t n_pressed;
+  matrix_row_t rows[MATRIX_ROWS];
+};
+
+// press or release of a single key
+struct key_event {
+  struct key_coord coord;
+  bool pressed;
+  uint32_t time_ms;  // uptime of the scan that saw the change
 };
 
 // keys encoded for USB HID report
 struct encoded_keys {
   uint8_t modifier_mask;
-  uint8_t keys[MAX_N_ENCODED_KEYS];
+  uint8_t keys[NKRO_BITMAP_BYTES];  // one bit per key usage
 };
 
+static inline void encoded_keys_set(struct encoded_keys *keys, uint8_t key,
+                                    bool pressed) {
+  if (key == 0 || key >= NKRO_N_USAGES) {  // 0 is no key
+    return;
+  }
+  if (pressed) {
+    keys->keys[key / 8] |= 1 << (key % 8);
+  } else {
+    keys->keys[key / 8] &= ~(1 << (key % 8));
+  }
+}
+
+static inline bool encoded_keys_get(const struct encoded_keys *keys,
+                                    uint8_t key) {
+  return key < NKRO_N_USAGES && (keys->keys[key / 8] & (1 << (key % 8)));
+}
+
 #endif  // CONFIG_H
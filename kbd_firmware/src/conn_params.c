@@ -0,0 +1,270 @@
+#include "conn_params.h"
+
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/toolchain.h>
+
+#include "config.h"
+
+// the peripheral may sleep through (1 + latency) intervals, the host must
+// not time out meanwhile
+BUILD_ASSERT(CONN_SUPERVISION_TIMEOUT * 10 >
+                 (1 + CONN_IDLE_LATENCY) * CONN_IDLE_INTERVAL_MAX * 5 / 4 * 2,
+             "supervision timeout too short for the idle latency");
+BUILD_ASSERT(CONN_SUPERVISION_TIMEOUT * 10 >
+                 (1 + CONN_SUBRATE_IDLE_LATENCY) * CONN_SUBRATE_IDLE_FACTOR *
+                     CONN_FAST_INTERVAL_MAX * 5 / 4 * 2,
+             "supervision timeout too short for the subrated latency");
+
+enum conn_mode {
+  CONN_MODE_FAST,
+  CONN_MODE_IDLE,
+  __CONN_N_MODES,
+};
+
+static const struct bt_le_conn_param mode_params[__CONN_N_MODES] = {
+    [CONN_MODE_FAST] = BT_LE_CONN_PARAM_INIT(
+        CONN_FAST_INTERVAL_MIN, CONN_FAST_INTERVAL_MAX, CONN_FAST_LATENCY,
+        CONN_SUPERVISION_TIMEOUT),
+    [CONN_MODE_IDLE] = BT_LE_CONN_PARAM_INIT(
+        CONN_IDLE_INTERVAL_MIN, CONN_IDLE_INTERVAL_MAX, CONN_IDLE_LATENCY,
+        CONN_SUPERVISION_TIMEOUT),
+};
+
+static const char *const mode_names[__CONN_N_MODES] = {"fast", "idle"};
+
+// subrate factor per mode, the underlying parameters stay fast
+static const struct bt_conn_le_subrate_param subrate_params[__CONN_N_MODES] = {
+    [CONN_MODE_FAST] = {.subrate_min = 1,
+                        .subrate_max = 1,
+                        .max_latency = CONN_FAST_LATENCY,
+                        .continuation_number = 0,
+                        .supervision_timeout = CONN_SUPERVISION_TIMEOUT},
+    [CONN_MODE_IDLE] = {.subrate_min = CONN_SUBRATE_IDLE_FACTOR,
+                        .subrate_max = CONN_SUBRATE_IDLE_FACTOR,
+                        .max_latency = CONN_SUBRATE_IDLE_LATENCY,
+                        .continuation_number = CONN_SUBRATE_CONTINUATION,
+                        .supervision_timeout = CONN_SUPERVISION_TIMEOUT},
+};
+
+// whether the host supports subrating, known after the first request
+enum subrate_support {
+  SUBRATE_UNKNOWN,
+  SUBRATE_SUPPORTED,
+  SUBRATE_UNSUPPORTED,
+};
+
+static void conn_params_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(conn_params_work, conn_params_work_handler);
+
+// only changed by the connection callbacks and conn_params_work_handler
+static struct {
+  struct bt_conn *conn;  // NULL if not connected
+  uint16_t interval;
+  uint16_t latency;
+  bool pending;  // waiting for the update of a request
+  enum conn_mode requested;
+  int64_t last_request_ms;
+  int64_t backoff_until_ms[__CONN_N_MODES];
+  enum subrate_support subrate_support;
+  uint16_t subrate_factor;  // 1 if not subrated
+  bool subrate_pending;
+  int64_t last_subrate_request_ms;
+} state = {0};
+
+// uptime of the last report, 32 bit to be set atomically
+static atomic_t last_activity_ms = ATOMIC_INIT(0);
+
+struct conn_params_stats conn_params_stats = {0};
+
+static bool params_match(enum conn_mode mode) {
+  const struct bt_le_conn_param *p = &mode_params[mode];
+  return state.interval >= p->interval_min &&
+         state.interval <= p->interval_max && state.latency == p->latency;
+}
+
+static void reject(enum conn_mode mode, int64_t now_ms) {
+  state.pending = false;
+  state.backoff_until_ms[mode] = now_ms + CONN_PARAMS_REJECT_BACKOFF_MS;
+  conn_params_stats.n_rejected++;
+  printk("Connection parameters %s rejected\n", mode_names[mode]);
+}
+
+static void request(enum conn_mode mode, int64_t now_ms) {
+  state.last_request_ms = now_ms;
+  int err = bt_conn_le_param_update(state.conn, &mode_params[mode]);
+  if (err == -EALREADY) {
+    return;  // already in use
+  }
+  conn_params_stats.n_requests++;
+  if (err) {
+    printk("Connection parameter update failed (err %d)\n", err);
+    reject(mode, now_ms);
+    return;
+  }
+  state.pending = true;
+  state.requested = mode;
+}
+
+static void subrate_unsupported() {
+  state.subrate_support = SUBRATE_UNSUPPORTED;
+  state.subrate_pending = false;
+  state.subrate_factor = 1;
+  printk("Subrating not supported, using idle parameters\n");
+}
+
+static void request_subrate(enum conn_mode mode, int64_t now_ms) {
+  state.last_subrate_request_ms = now_ms;
+  int err = bt_conn_le_subrate_request(state.conn, &subrate_params[mode]);
+  if (err) {
+    printk("Subrate request failed (err %d)\n", err);
+    subrate_unsupported();
+    return;
+  }
+  state.subrate_pending = true;
+}
+
+// Requests the subrate factor of the wanted mode, returns when to look again.
+// Going fast isn't rate limited, it is what makes the next keystrokes fast.
+static int64_t update_subrate(enum conn_mode wanted, int64_t now_ms) {
+  if (state.subrate_pending &&
+      now_ms - state.last_subrate_request_ms >=
+          CONN_PARAMS_RESPONSE_TIMEOUT_MS) {
+    subrate_unsupported();
+  }
+  if (state.subrate_support == SUBRATE_UNSUPPORTED) {
+    return INT64_MAX;
+  }
+  if (!state.subrate_pending &&
+      (state.subrate_factor > 1) != (wanted == CONN_MODE_IDLE)) {
+    int64_t allowed_ms =
+        wanted == CONN_MODE_FAST
+            ? now_ms
+            : state.last_subrate_request_ms +
+                  CONN_PARAMS_MIN_REQUEST_INTERVAL_MS;
+    if (now_ms < allowed_ms) {
+      return allowed_ms;
+    }
+    request_subrate(wanted, now_ms);
+  }
+  if (state.subrate_pending) {
+    return state.last_subrate_request_ms + CONN_PARAMS_RESPONSE_TIMEOUT_MS;
+  }
+  return INT64_MAX;
+}
+
+static void conn_params_work_handler(struct k_work *work) {
+  if (!state.conn) {
+    return;
+  }
+  int64_t now_ms = k_uptime_get();
+  if (state.pending &&
+      now_ms - state.last_request_ms >= CONN_PARAMS_RESPONSE_TIMEOUT_MS) {
+    reject(state.requested, now_ms);
+  }
+
+  uint32_t idle_ms =
+      k_uptime_get_32() - (uint32_t)atomic_get(&last_activity_ms);
+  enum conn_mode wanted =
+      idle_ms < CONN_IDLE_AFTER_MS ? CONN_MODE_FAST : CONN_MODE_IDLE;
+  // when to look again
+  int64_t next_ms = INT64_MAX;
+  if (wanted == CONN_MODE_FAST) {
+    next_ms = now_ms + CONN_IDLE_AFTER_MS - idle_ms;
+  }
+  next_ms = MIN(next_ms, update_subrate(wanted, now_ms));
+  if (state.subrate_support != SUBRATE_UNSUPPORTED) {
+    // idle is subrated, the parameters stay fast
+    wanted = CONN_MODE_FAST;
+  }
+  if (!state.pending && !params_match(wanted)) {
+    int64_t allowed_ms =
+        MAX(state.last_request_ms + CONN_PARAMS_MIN_REQUEST_INTERVAL_MS,
+            state.backoff_until_ms[wanted]);
+    if (now_ms >= allowed_ms) {
+      request(wanted, now_ms);
+    } else {
+      next_ms = MIN(next_ms, allowed_ms);
+    }
+  }
+  if (state.pending) {
+    next_ms =
+        MIN(next_ms, state.last_request_ms + CONN_PARAMS_RESPONSE_TIMEOUT_MS);
+  }
+  if (next_ms != INT64_MAX) {
+    k_work_reschedule(&conn_params_work, K_MSEC(next_ms - now_ms));
+  }
+}
+
+void conn_params_connected(struct bt_conn *conn) {
+  struct bt_conn_info info;
+  if (bt_conn_get_info(conn, &info) == 0) {
+    state.interval = info.le.interval;
+    state.latency = info.le.latency;
+  }
+  state.conn = conn;
+  state.pending = false;
+  // the stack holds back requests while the host sets up the link
+  int64_t now_ms = k_uptime_get();
+  state.last_request_ms = now_ms;
+  for (uint8_t i = 0; i < __CONN_N_MODES; i++) {
+    state.backoff_until_ms[i] = now_ms + CONN_PARAMS_FIRST_REQUEST_MS;
+  }
+  conn_params_stats.latency = state.latency;
+  state.subrate_support = SUBRATE_UNKNOWN;
+  state.subrate_factor = 1;
+  state.subrate_pending = false;
+  state.last_subrate_request_ms = now_ms;
+  conn_params_stats.subrate_factor = 1;
+  conn_params_activity();
+  k_work_reschedule(&conn_params_work, K_NO_WAIT);
+}
+
+void conn_params_updated(uint16_t interval, uint16_t latency) {
+  state.interval = interval;
+  state.latency = latency;
+  conn_params_stats.latency = latency;
+  if (state.pending) {
+    state.pending = false;
+    if (!params_match(state.requested)) {
+      // the host chose its own parameters, keep them for a while
+      reject(state.requested, k_uptime_get());
+    }
+  }
+  k_work_reschedule(&conn_params_work, K_NO_WAIT);
+}
+
+void conn_params_subrate_changed(uint8_t status, uint16_t factor) {
+  state.subrate_pending = false;
+  if (status) {
+    printk("Subrate change failed (status 0x%02x)\n", status);
+    // retrying would only delay falling back to the idle parameters
+    subrate_unsupported();
+  } else {
+    state.subrate_support = SUBRATE_SUPPORTED;
+    state.subrate_factor = factor;
+  }
+  conn_params_stats.subrate_factor = state.subrate_factor;
+  k_work_reschedule(&conn_params_work, K_NO_WAIT);
+}
+
+void conn_params_disconnected() {
+  state.conn = NULL;
+  state.pending = false;
+  conn_params_stats.latency = 0;
+  k_work_cancel_delayable(&conn_params_work);
+}
+
+void conn_params_activity() {
+  atomic_set(&last_activity_ms, k_uptime_get_32());
+  // while fast the work already wakes up for the idle timeout
+  bool slow = state.subrate_factor > 1 ||
+              (!state.pending && !params_match(CONN_MODE_FAST) &&
+               k_uptime_get() >= state.backoff_until_ms[CONN_MODE_FAST]);
+  if (state.conn && slow) {
+    k_work_reschedule(&conn_params_work, K_NO_WAIT);
+  }
+}
@@ -0,0 +1,28 @@
+#ifndef CONN_PARAMS_H
+#define CONN_PARAMS_H
+
+#include <stdint.h>
+#include <zephyr/bluetooth/conn.h>
+
+// Requests fast connection parameters while typing. When idle the link is
+// subrated if the host supports it, else slow parameters with a high
+// peripheral latency are requested, see CONN_* in config.h. Called from
+// bluetooth.c, which forwards the connection events.
+
+struct conn_params_stats {
+  uint16_t latency;  // current peripheral latency
+  uint16_t subrate_factor;
+  uint32_t n_requests;
+  uint32_t n_rejected;
+};
+
+extern struct conn_params_stats conn_params_stats;
+
+void conn_params_connected(struct bt_conn *conn);
+void conn_params_updated(uint16_t interval, uint16_t latency);
+void conn_params_subrate_changed(uint8_t status, uint16_t factor);
+void conn_params_disconnected();
+// a report was sent to the host
+void conn_params_activity();
+
+#endif  // CONN_PARAMS_H
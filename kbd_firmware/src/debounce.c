@@ -0,0 +1,48 @@
+#include "debounce.h"
+
+#include <zephyr/sys/util.h>
+
+// keys with a raw state different from the debounced one, waiting for their
+// deadline
+static matrix_row_t pending[MATRIX_ROWS];
+// ms timestamp (truncated) at which a pending change is reported
+static uint16_t deadline_ms[MATRIX_ROWS][MATRIX_COLS];
+
+static inline bool deadline_reached(uint16_t deadline, uint16_t now) {
+  return (int16_t)(now - deadline) >= 0;
+}
+
+bool debounce(const matrix_row_t raw[MATRIX_ROWS],
+              matrix_row_t debounced[MATRIX_ROWS], uint32_t now_ms) {
+  uint16_t now = (uint16_t)now_ms;
+  bool any_pending = false;
+
+  for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+    matrix_row_t changed = raw[row] ^ debounced[row];
+    // keys that bounced back to their debounced state restart their timer
+    // on the next change
+    pending[row] &= changed;
+
+    while (changed) {
+      uint8_t col = __builtin_ctz(changed);
+      matrix_row_t bit = BIT(col);
+      changed &= ~bit;
+      bool press = raw[row] & bit;
+
+      if (!(pending[row] & bit)) {
+        if (press && DEBOUNCE_MODE == DEBOUNCE_EAGER_PRESS) {
+          debounced[row] |= bit;
+          continue;
+        }
+        pending[row] |= bit;
+        deadline_ms[row][col] =
+            now + (press ? DEBOUNCE_PRESS_MS : DEBOUNCE_RELEASE_MS);
+      } else if (deadline_reached(deadline_ms[row][col], now)) {
+        debounced[row] ^= bit;
+        pending[row] &= ~bit;
+      }
+    }
+    any_pending |= pending[row] != 0;
+  }
+  return any_pending;
+}
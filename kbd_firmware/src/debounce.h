@@ -0,0 +1,24 @@
+#ifndef DEBOUNCE_H
+#define DEBOUNCE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+enum debounce_mode {
+  // report presses on the first raw edge, releases only after the key has
+  // been released for DEBOUNCE_RELEASE_MS (lowest press latency)
+  DEBOUNCE_EAGER_PRESS,
+  // report presses and releases only after the key has been stable for
+  // DEBOUNCE_PRESS_MS / DEBOUNCE_RELEASE_MS (also filters noise on presses)
+  DEBOUNCE_DEFERRED,
+};
+
+// Update the debounced state from a raw scan taken at now_ms.
+// Returns true while any key still has an unresolved change, i.e. the
+// matrix needs to be scanned again even if nothing is pressed.
+bool debounce(const matrix_row_t raw[MATRIX_ROWS],
+              matrix_row_t debounced[MATRIX_ROWS], uint32_t now_ms);
+
+#endif  // DEBOUNCE_H
@@ -11,8 +11,12 @@
 #include <zephyr/kernel.h>
 #include <zephyr/sys/byteorder.h>
 #include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/timing/timing.h>
 #include <zephyr/types.h>
 
+#include "config.h"
+
 const char FONT[][6] = {
     {0x00, 0x00, 0x00, 0x00, 0x00, 0x00},  // sp
     {0x00, 0x00, 0x00, 0x2f, 0x00, 0x00},  // !
@@ -160,6 +164,52 @@ static struct {
 } cursorPosition;
 
 uint8_t displayBuffer[DISPLAY_HEIGHT / 8][DISPLAY_WIDTH];
+// what the display RAM holds, lcd_display() only sends the differences
+static uint8_t panelBuffer[DISPLAY_HEIGHT / 8][DISPLAY_WIDTH];
+// panelBuffer is unknown after power up
+static bool panel_valid = false;
+
+// Columns drawn to since the last lcd_display(), per line. start >= end if
+// none.
+static struct {
+  uint8_t start;
+  uint8_t end;  // exclusive
+} dirty[DISPLAY_HEIGHT / 8];
+
+// Setting the address window costs a command transfer (address, control and
+// 6 command bytes) and the address and control bytes of the data transfer,
+// so unchanged gaps shorter than this are sent along.
+#define SPAN_MERGE_GAP 10
+
+// An address window of the frame being sent, its data is in panelBuffer.
+struct window {
+  uint8_t cmds[6];
+  uint8_t *data;
+  uint16_t len;
+};
+
+// changed columns at least SPAN_MERGE_GAP + 1 apart, e.g. x = 0, 11, ..., 121
+#define MAX_WINDOWS \
+  (DISPLAY_HEIGHT / 8 * (DISPLAY_WIDTH / (SPAN_MERGE_GAP + 1) + 1))
+
+// Frames are sent in the background, one I2C transfer after the other.
+// panelBuffer is the front buffer, it's only written between frames while
+// display_idle is available, drawing goes on in displayBuffer.
+static struct window windows[MAX_WINDOWS];
+static uint8_t n_windows = 0;
+static uint8_t next_step = 0;  // two per window, command then data
+static K_SEM_DEFINE(display_idle, 1, 1);
+static struct i2c_msg frame_msgs[2];
+static uint8_t control_command = 0x00;
+static uint8_t control_data = 0x40;
+static volatile int frame_error = 0;
+
+static void frame_work_handler(struct k_work *work);
+static K_WORK_DEFINE(frame_work, frame_work_handler);
+
+struct display_stats display_stats = {.bus_khz = 400};
+// I2C_SPEED_FAST from the devicetree or I2C_SPEED_FAST_PLUS
+static uint32_t bus_speed = I2C_SPEED_FAST;
 
 void init_i2c(void) {
   while (!device_is_ready(dev_i2c.bus)) {
@@ -168,7 +218,53 @@ void init_i2c(void) {
   };
 }
 
+static void mark_dirty(uint8_t line, int16_t x1, int16_t x2) {
+  if (line >= DISPLAY_HEIGHT / 8 || x2 < 0 || x1 >= DISPLAY_WIDTH) {
+    return;
+  }
+  x1 = MAX(x1, 0);
+  x2 = MIN(x2, DISPLAY_WIDTH - 1);
+  if (dirty[line].start >= dirty[line].end) {
+    dirty[line].start = x1;
+    dirty[line].end = x2 + 1;
+  } else {
+    dirty[line].start = MIN(dirty[line].start, x1);
+    dirty[line].end = MAX(dirty[line].end, x2 + 1);
+  }
+}
+
+// marks the pixel rectangle between the corners, in any order
+static void mark_dirty_rect(int16_t x1, int16_t y1, int16_t x2, int16_t y2) {
+  int16_t ymin = MAX(MIN(y1, y2), 0);
+  int16_t ymax = MIN(MAX(y1, y2), DISPLAY_HEIGHT - 1);
+  for (int16_t line = ymin / 8; line <= ymax / 8; line++) {
+    mark_dirty(line, MIN(x1, x2), MAX(x1, x2));
+  }
+}
+
+void lcd_mark_dirty(uint8_t x, uint8_t line, uint8_t width, uint8_t n_lines) {
+  for (uint8_t i = 0; i < n_lines; i++) {
+    mark_dirty(line + i, x, x + width - 1);
+  }
+}
+
+// display_idle is given back by frame_work on the system workqueue (and the
+// I2C callback), waiting for it there or in an ISR would never return
+static void assert_may_wait(void) {
+  __ASSERT(!k_is_in_isr(), "display can't wait in an ISR");
+  __ASSERT(k_current_get() != k_work_queue_thread_get(&k_sys_work_q),
+           "display can't wait on the system workqueue");
+}
+
+// waits until the frame being sent reached the display
+static void wait_idle(void) {
+  assert_may_wait();
+  k_sem_take(&display_idle, K_FOREVER);
+  k_sem_give(&display_idle);
+}
+
 int lcd_command(const uint8_t *cmds, size_t len) {
+  wait_idle();
   struct i2c_msg mode_msg;
   uint8_t is_command = 0x00;
   mode_msg.buf = &is_command;
@@ -182,13 +278,16 @@ int lcd_command(const uint8_t *cmds, size_t len) {
 
   struct i2c_msg msgs[] = {mode_msg, data_msg};
   int ret = i2c_transfer(dev_i2c.bus, msgs, 2, dev_i2c.addr);
+  display_stats.n_bytes += 2 + len;  // address and control byte
   if (ret != 0) {
+    display_stats.n_errors++;
     printk("Error %d: failed to write command to the display\n", ret);
   }
   return ret;
 }
 
 int lcd_data(const uint8_t *data, size_t len) {
+  wait_idle();
   struct i2c_msg mode_msg;
   uint8_t is_data = 0x40;
   mode_msg.buf = &is_data;
@@ -202,7 +301,9 @@ int lcd_data(const uint8_t *data, size_t len) {
 
   struct i2c_msg msgs[] = {mode_msg, data_msg};
   int ret = i2c_transfer(dev_i2c.bus, msgs, 2, dev_i2c.addr);
+  display_stats.n_bytes += 2 + len;
   if (ret != 0) {
+    display_stats.n_errors++;
     printk("Error %d: failed to write data to the display\n", ret);
   }
   return ret;
@@ -228,6 +329,8 @@ void lcd_send_goto_xpix_y(uint8_t x, uint8_t y) {
 void lcd_send_home_command() { lcd_send_goto_xpix_y(0, 0); }
 
 void lcd_putc(char c) {
+  mark_dirty(cursorPosition.y, cursorPosition.x,
+             cursorPosition.x + sizeof(FONT[0]) - 1);
   // mapping char
   c -= ' ';
   for (uint8_t i = 0; i < sizeof(FONT[0]); i++) {
@@ -251,6 +354,8 @@ void lcd_puts(const char *s) {
 }
 
 void lcd_putc_invert(char c) {
+  mark_dirty(cursorPosition.y, cursorPosition.x,
+             cursorPosition.x + sizeof(FONT[0]) - 1);
   // mapping char
   c -= ' ';
   for (uint8_t i = 0; i < sizeof(FONT[0]); i++) {
@@ -277,6 +382,7 @@ void lcd_puts_invert(const char *s) {
 void lcd_clear_buffer() {
   for (uint8_t i = 0; i < DISPLAY_HEIGHT / 8; i++) {
     memset(displayBuffer[i], 0x00, sizeof(displayBuffer[i]));
+    mark_dirty(i, 0, DISPLAY_WIDTH - 1);
   }
 }
 
@@ -285,10 +391,143 @@ uint8_t lcd_check_buffer(uint8_t x, uint8_t y) {
          (1 << (y % (DISPLAY_HEIGHT / 8)));
 }
 
+static void frame_transfer_done(const struct device *dev, int result,
+                                void *data) {
+  frame_error = result;
+  // called from the interrupt, the next transfer starts in the work queue
+  k_work_submit(&frame_work);
+}
+
+static void frame_work_handler(struct k_work *work) {
+  if (frame_error || next_step == 2 * n_windows) {
+    if (frame_error) {
+      printk("Error %d: failed to write frame to the display\n", frame_error);
+      frame_error = 0;
+      display_stats.n_errors++;
+      // the display RAM is unknown, send everything with the next frame
+      panel_valid = false;
+    }
+    k_sem_give(&display_idle);
+    return;
+  }
+  struct window *w = &windows[next_step / 2];
+  bool is_data = next_step % 2;
+  next_step++;
+  frame_msgs[0] = (struct i2c_msg){
+      .buf = is_data ? &control_data : &control_command,
+      .len = 1,
+      .flags = I2C_MSG_WRITE,
+  };
+  frame_msgs[1] = (struct i2c_msg){
+      .buf = is_data ? w->data : w->cmds,
+      .len = is_data ? w->len : sizeof(w->cmds),
+      .flags = I2C_MSG_WRITE | I2C_MSG_STOP,
+  };
+  display_stats.n_bytes += 2 + frame_msgs[1].len;
+  int ret = i2c_transfer_cb(dev_i2c.bus, frame_msgs, 2, dev_i2c.addr,
+                            frame_transfer_done, NULL);
+  if (ret != 0) {
+    frame_transfer_done(dev_i2c.bus, ret, NULL);
+  }
+}
+
+// adds columns x1..x2 of lines line1..line2 to the frame, a window spanning
+// several lines has to cover their full width
+// returns false if the window list is full
+static bool add_window(uint8_t x1, uint8_t x2, uint8_t line1, uint8_t line2) {
+  if (n_windows == MAX_WINDOWS) {
+    return false;
+  }
+  struct window *w = &windows[n_windows++];
+  memcpy(w->cmds, (uint8_t[]){0x22, line1, line2, 0x21, x1, x2},
+         sizeof(w->cmds));
+  for (uint8_t line = line1; line <= line2; line++) {
+    memcpy(&panelBuffer[line][x1], &displayBuffer[line][x1], x2 - x1 + 1);
+  }
+  // the lines of a window follow each other in panelBuffer
+  w->data = &panelBuffer[line1][x1];
+  w->len = (line2 - line1 + 1) * (x2 - x1 + 1);
+  return true;
+}
+
+static bool column_changed(uint8_t line, uint8_t x) {
+  return displayBuffer[line][x] != panelBuffer[line][x];
+}
+
+// Adds the changed columns of a line, nearby ones merged into one window.
+// Returns false if the window list is full.
+static bool add_changed_columns(uint8_t line) {
+  int16_t span_start = -1;
+  int16_t span_end = -1;
+  for (uint8_t x = dirty[line].start; x < dirty[line].end; x++) {
+    if (!column_changed(line, x)) {
+      continue;
+    }
+    if (span_start >= 0 && x - span_end > SPAN_MERGE_GAP) {
+      if (!add_window(span_start, span_end, line, line)) {
+        return false;
+      }
+      span_start = -1;
+    }
+    if (span_start < 0) {
+      span_start = x;
+    }
+    span_end = x;
+  }
+  return span_start < 0 || add_window(span_start, span_end, line, line);
+}
+
+// Copies the changes to panelBuffer and starts sending them. display_idle
+// has to be taken, it is given back once the frame was sent.
+static void submit_frame(void) {
+  n_windows = 0;
+  next_step = 0;
+  if (!panel_valid) {
+    add_window(0, DISPLAY_WIDTH - 1, 0, DISPLAY_HEIGHT / 8 - 1);
+    panel_valid = true;
+  } else {
+    for (uint8_t line = 0; line < DISPLAY_HEIGHT / 8; line++) {
+      if (dirty[line].start < dirty[line].end &&
+          !add_changed_columns(line)) {
+        // not expected with MAX_WINDOWS, send the whole frame instead
+        n_windows = 0;
+        add_window(0, DISPLAY_WIDTH - 1, 0, DISPLAY_HEIGHT / 8 - 1);
+        break;
+      }
+    }
+  }
+  memset(dirty, 0, sizeof(dirty));
+  lcd_goto_xpix_y(0, 0);
+
+  uint16_t n_bytes = 0;
+  for (uint8_t i = 0; i < n_windows; i++) {
+    // address and control byte of both transfers
+    n_bytes += 4 + sizeof(windows[i].cmds) + windows[i].len;
+  }
+  display_stats.n_frames++;
+  display_stats.last_frame_bytes = n_bytes;
+  if (n_windows == 0) {
+    k_sem_give(&display_idle);
+    return;
+  }
+  k_work_submit(&frame_work);
+}
+
 void lcd_display() {
-  lcd_send_home_command();
-  lcd_data(&displayBuffer[0][0], DISPLAY_WIDTH * DISPLAY_HEIGHT / 8);
+  assert_may_wait();
+  k_sem_take(&display_idle, K_FOREVER);
+  submit_frame();
+}
+
+int lcd_display_async(void) {
+  if (k_sem_take(&display_idle, K_NO_WAIT) != 0) {
+    display_stats.n_dropped++;
+    return -EBUSY;
+  }
+  submit_frame();
+  return 0;
 }
+
 void lcd_clrscr(void) {
   lcd_clear_buffer();
   lcd_display();
@@ -310,6 +549,7 @@ void enable_display(void) {
 }
 
 void disable_display(void) {
+  wait_idle();
   if (display_enabled()) {
     int ret = regulator_disable(disp_ldsw);
     if (ret != 0) {
@@ -318,6 +558,51 @@ void disable_display(void) {
   }
 }
 
+static int set_bus_speed(uint32_t speed) {
+  wait_idle();
+  int ret =
+      i2c_configure(dev_i2c.bus, I2C_MODE_CONTROLLER | I2C_SPEED_SET(speed));
+  if (ret != 0) {
+    printk("Error %d: failed to set the display bus speed\n", ret);
+    return ret;
+  }
+  bus_speed = speed;
+  display_stats.bus_khz = speed == I2C_SPEED_FAST_PLUS ? 1000 : 400;
+  return 0;
+}
+
+// The display can't be read over I2C, so a bus speed is verified by sending
+// full frames without a transfer error (NACK or timeout).
+#define BUS_CHECK_FRAMES 4
+
+static int check_bus(void) {
+  uint32_t n_errors = display_stats.n_errors;
+  for (uint8_t i = 0; i < BUS_CHECK_FRAMES; i++) {
+    panel_valid = false;
+    lcd_display();
+  }
+  wait_idle();
+  return display_stats.n_errors == n_errors ? 0 : -EIO;
+}
+
+// Raises the bus to fast-plus once per boot and keeps it if it works.
+static void init_bus_speed(void) {
+  static bool checked = false;
+  if (!DISPLAY_I2C_FAST_PLUS || checked) {
+    return;
+  }
+  checked = true;
+  if (set_bus_speed(I2C_SPEED_FAST_PLUS) != 0) {
+    return;
+  }
+  if (check_bus() != 0) {
+    printk("Display bus errors at 1MHz, using 400kHz\n");
+    set_bus_speed(I2C_SPEED_FAST);
+    return;
+  }
+  printk("Display bus at 1MHz\n");
+}
+
 void display_init(void) {
   lcd_clear_buffer();
   enable_display();
@@ -329,10 +614,82 @@ void display_init(void) {
     printk("Error %d: failed to write to the display\n", ret);
   }
   k_msleep(50);  // Wait for display to turn on
+  init_bus_speed();
+  panel_valid = false;
   lcd_display();
 }
 
-void lcd_drawPixel(uint8_t x, uint8_t y, uint8_t color) {
+#ifdef CONFIG_TIMING_FUNCTIONS
+#define DISPLAY_BENCHMARK_FRAMES 20
+
+struct flush_time {
+  uint32_t cpu_ns;    // spent in lcd_display(), diffing and copying
+  uint32_t total_ns;  // until the frame reached the display
+  uint16_t n_bytes;
+};
+
+// partial frames change one character per frame
+static struct flush_time benchmark_flush(bool full) {
+  uint64_t cpu_cycles = 0;
+  uint64_t total_cycles = 0;
+  uint32_t n_bytes = 0;
+  for (int i = 0; i < DISPLAY_BENCHMARK_FRAMES; i++) {
+    if (full) {
+      panel_valid = false;
+    } else {
+      lcd_gotoxy(i % (DISPLAY_WIDTH / sizeof(FONT[0])), i % 8);
+      lcd_putc('0' + i % 10);
+    }
+    timing_t start = timing_counter_get();
+    lcd_display();
+    timing_t submitted = timing_counter_get();
+    wait_idle();
+    timing_t end = timing_counter_get();
+    cpu_cycles += timing_cycles_get(&start, &submitted);
+    total_cycles += timing_cycles_get(&start, &end);
+    n_bytes += display_stats.last_frame_bytes;
+  }
+  return (struct flush_time){
+      .cpu_ns = timing_cycles_to_ns(cpu_cycles) / DISPLAY_BENCHMARK_FRAMES,
+      .total_ns = timing_cycles_to_ns(total_cycles) / DISPLAY_BENCHMARK_FRAMES,
+      .n_bytes = n_bytes / DISPLAY_BENCHMARK_FRAMES,
+  };
+}
+
+static void print_flush_time(const char *name, struct flush_time t) {
+  printk("  %s: %u bytes in %uus (%u bytes/s), cpu %uus\n", name, t.n_bytes,
+         t.total_ns / 1000,
+         (uint32_t)((uint64_t)t.n_bytes * 1000000000 / MAX(t.total_ns, 1)),
+         t.cpu_ns / 1000);
+}
+
+void benchmark_display(void) {
+  display_init();
+  uint32_t selected_speed = bus_speed;
+  const uint32_t speeds[] = {I2C_SPEED_FAST, I2C_SPEED_FAST_PLUS};
+  timing_start();
+  for (uint8_t i = 0; i < ARRAY_SIZE(speeds); i++) {
+    if (set_bus_speed(speeds[i]) != 0) {
+      continue;
+    }
+    uint32_t n_errors = display_stats.n_errors;
+    lcd_clear_buffer();
+    struct flush_time full = benchmark_flush(true);
+    struct flush_time partial = benchmark_flush(false);
+    printk("display at %dkHz, %d errors\n", display_stats.bus_khz,
+           display_stats.n_errors - n_errors);
+    print_flush_time("full", full);
+    print_flush_time("partial", partial);
+  }
+  timing_stop();
+  set_bus_speed(selected_speed);
+  lcd_clear_buffer();
+  lcd_display();
+  disable_display();
+}
+#endif
+
+static void put_pixel(uint8_t x, uint8_t y, uint8_t color) {
   if (color == WHITE) {
     displayBuffer[(y / (DISPLAY_HEIGHT / 8))][x] |=
         (1 << (y % (DISPLAY_HEIGHT / 8)));
@@ -342,6 +699,11 @@ void lcd_drawPixel(uint8_t x, uint8_t y, uint8_t color) {
   }
 }
 
+void lcd_drawPixel(uint8_t x, uint8_t y, uint8_t color) {
+  put_pixel(x, y, color);
+  mark_dirty(y / 8, x, x);
+}
+
 void lcd_display_block(uint8_t x, uint8_t line, uint8_t width) {
   if (line > (DISPLAY_HEIGHT / 8 - 1) || x > DISPLAY_WIDTH - 1) {
     return;
@@ -350,20 +712,53 @@ void lcd_display_block(uint8_t x, uint8_t line, uint8_t width) {
     width = DISPLAY_WIDTH - x;
   }
   lcd_send_goto_xpix_y(x, line);
+  memcpy(&panelBuffer[line][x], &displayBuffer[line][x], width);
   lcd_data(&displayBuffer[line][x], width);
 }
 
-void lcd_drawLine(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2,
-                  uint8_t color) {
-  if (x1 > DISPLAY_WIDTH - 1 || x2 > DISPLAY_WIDTH - 1 ||
-      y1 > DISPLAY_HEIGHT - 1 || y2 > DISPLAY_HEIGHT - 1)
-    return;
+// bits of a page byte at and below / at and above a row within the page
+static const uint8_t top_masks[8] = {0xFF, 0xFE, 0xFC, 0xF8,
+                                     0xF0, 0xE0, 0xC0, 0x80};
+static const uint8_t bottom_masks[8] = {0x01, 0x03, 0x07, 0x0F,
+                                        0x1F, 0x3F, 0x7F, 0xFF};
+
+// Fills x1..x2, y1..y2 (ordered, on screen) a page byte at a time. Bytes
+// covering all 8 rows are set with memset.
+static void fill_rect(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2,
+                      uint8_t color) {
+  mark_dirty_rect(x1, y1, x2, y2);
+  uint8_t width = x2 - x1 + 1;
+  for (uint8_t line = y1 / 8; line <= y2 / 8; line++) {
+    uint8_t mask = 0xFF;
+    if (line == y1 / 8) {
+      mask &= top_masks[y1 % 8];
+    }
+    if (line == y2 / 8) {
+      mask &= bottom_masks[y2 % 8];
+    }
+    uint8_t *bytes = &displayBuffer[line][x1];
+    if (mask == 0xFF) {
+      memset(bytes, color == WHITE ? 0xFF : 0x00, width);
+    } else if (color == WHITE) {
+      for (uint8_t i = 0; i < width; i++) {
+        bytes[i] |= mask;
+      }
+    } else {
+      for (uint8_t i = 0; i < width; i++) {
+        bytes[i] &= ~mask;
+      }
+    }
+  }
+}
+
+static void draw_line_pixels(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2,
+                             uint8_t color) {
   int dx = abs((int)x2 - x1), sx = x1 < x2 ? 1 : -1;
   int dy = -abs((int)y2 - y1), sy = y1 < y2 ? 1 : -1;
   int err = dx + dy, e2; /* error value e_xy */
 
   while (1) {
-    lcd_drawPixel(x1, y1, color);
+    put_pixel(x1, y1, color);
     if (x1 == x2 && y1 == y2) break;
     e2 = 2 * err;
     if (e2 > dy) {
@@ -377,10 +772,81 @@ void lcd_drawLine(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2,
   }
 }
 
+void lcd_drawLine(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2,
+                  uint8_t color) {
+  if (x1 > DISPLAY_WIDTH - 1 || x2 > DISPLAY_WIDTH - 1 ||
+      y1 > DISPLAY_HEIGHT - 1 || y2 > DISPLAY_HEIGHT - 1)
+    return;
+  if (x1 == x2 || y1 == y2) {
+    fill_rect(MIN(x1, x2), MIN(y1, y2), MAX(x1, x2), MAX(y1, y2), color);
+    return;
+  }
+  mark_dirty_rect(x1, y1, x2, y2);
+  draw_line_pixels(x1, y1, x2, y2, color);
+}
+
 void lcd_fillRect(uint8_t px1, uint8_t py1, uint8_t px2, uint8_t py2,
                   uint8_t color) {
-  for (uint8_t i = 0; i <= (py2 - py1); i++) {
-    lcd_drawLine(px1, py1 + i, px2, py1 + i, color);
+  // like a horizontal line per row: nothing if a corner is right of the
+  // screen, rows below it are left out
+  if (px1 > DISPLAY_WIDTH - 1 || px2 > DISPLAY_WIDTH - 1 || py1 > py2 ||
+      py1 > DISPLAY_HEIGHT - 1) {
+    return;
+  }
+  fill_rect(MIN(px1, px2), py1, MAX(px1, px2), MIN(py2, DISPLAY_HEIGHT - 1),
+            color);
+}
+
+// ors or clears the pixels from x1 to x2 of row y
+static void fill_span(uint8_t x1, uint8_t x2, uint8_t y, uint8_t color) {
+  uint8_t mask = 1 << (y % 8);
+  uint8_t *bytes = displayBuffer[y / 8];
+  if (color == WHITE) {
+    for (uint8_t x = x1; x <= x2; x++) {
+      bytes[x] |= mask;
+    }
+  } else {
+    for (uint8_t x = x1; x <= x2; x++) {
+      bytes[x] &= ~mask;
+    }
+  }
+}
+
+// edge function a * x + b of the current row, b advances by step per row
+struct edge {
+  int32_t a, b, step;
+};
+
+// (xb - xa) * (y - ya) - (yb - ya) * (x - xa) split into a and b for row y
+static struct edge edge_at_row(int16_t xa, int8_t ya, int16_t xb, int8_t yb,
+                               int16_t y) {
+  return (struct edge){
+      .a = ya - yb,
+      .b = (int32_t)(xb - xa) * (y - ya) + (int32_t)(yb - ya) * xa,
+      .step = xb - xa,
+  };
+}
+
+// rounds towards negative infinity, d > 0
+static int32_t floor_div(int32_t n, int32_t d) {
+  return n >= 0 ? n / d : -((d - 1 - n) / d);
+}
+
+// narrows lo..hi to the x where the edge function is > 0, or <= 0 if not
+// positive
+static void clip_to_edge(const struct edge *e, bool positive, int16_t *lo,
+                         int16_t *hi) {
+  if (e->a == 0) {
+    if ((e->b > 0) != positive) *hi = *lo - 1;
+    return;
+  }
+  // last x on the <= 0 side for a > 0, last x on the > 0 side for a < 0
+  int32_t bound =
+      e->a > 0 ? floor_div(-e->b, e->a) : floor_div(e->b - 1, -e->a);
+  if ((e->a > 0) == positive) {
+    if (bound + 1 > *lo) *lo = MIN(bound + 1, DISPLAY_WIDTH);
+  } else {
+    if (bound < *hi) *hi = MAX(bound, -1);
   }
 }
 
@@ -388,41 +854,46 @@ void lcd_fillTriangle(int16_t x1, int8_t y1, int16_t x2, int8_t y2, int16_t x3,
                       int8_t y3, uint8_t color) {
   // Negative and too large coords are allowed, only the visible part will
   // be drawn
+  int16_t xmin = MAX(MIN(MIN(x1, x2), x3), 0);
+  int16_t xmax = MIN(MAX(MAX(x1, x2), x3), DISPLAY_WIDTH - 1);
+  int16_t ymin = MAX(MIN(MIN(y1, y2), y3), 0);
+  int16_t ymax = MIN(MAX(MAX(y1, y2), y3), DISPLAY_HEIGHT - 1);
+  // twice the signed area, the inside is where all edges have its sign
+  int32_t area =
+      (int32_t)(x2 - x1) * (y3 - y1) - (int32_t)(y2 - y1) * (x3 - x1);
+  if (xmin > xmax || ymin > ymax || area == 0) return;
+  mark_dirty_rect(xmin, ymin, xmax, ymax);
 
-  // calc bounds for increased performance (todo: is there a better way?)
-  int16_t xmin = (x1 < x2 ? (x1 < x3 ? x1 : x3) : (x2 < x3 ? x2 : x3));
-  if (xmin < 0) xmin = 0;
-  int16_t xmax = (x1 > x2 ? (x1 > x3 ? x1 : x3) : (x2 > x3 ? x2 : x3));
-  if (xmax > DISPLAY_WIDTH - 1) xmax = DISPLAY_WIDTH - 1;
-
-  int8_t ymin = (y1 < y2 ? (y1 < y3 ? y1 : y3) : (y2 < y3 ? y2 : y3));
-  if (ymin < 0) ymin = 0;
-  int8_t ymax = (y1 > y2 ? (y1 > y3 ? y1 : y3) : (y2 > y3 ? y2 : y3));
-  if (ymax > DISPLAY_HEIGHT - 1) ymax = DISPLAY_HEIGHT - 1;
-
-  for (uint8_t x = xmin; x <= xmax; x++) {
-    for (uint8_t y = ymin; y <= ymax; y++) {
-      // point in triangle code from John Bananas on stackoverflow
-      // https://stackoverflow.com/a/9755252/7089433
-      int8_t p1x = x - x1;
-      int8_t p1y = y - y1;
-      uint8_t s12 = (x2 - x1) * p1y - (y2 - y1) * p1x > 0;
-      if (((x3 - x1) * p1y - (y3 - y1) * p1x > 0) == s12) continue;
-      if (((x3 - x2) * (y - y2) - (y3 - y2) * (x - x2) > 0) != s12) continue;
-      lcd_drawPixel(x, y, color);
-    }
+  // Walks the edges row by row and solves the point in triangle test of
+  // John Bananas (https://stackoverflow.com/a/9755252/7089433) for the span
+  // of each row, so the pixels match the test done for every pixel
+  bool s12 = area > 0;
+  struct edge e12 = edge_at_row(x1, y1, x2, y2, ymin);
+  struct edge e13 = edge_at_row(x1, y1, x3, y3, ymin);
+  struct edge e23 = edge_at_row(x2, y2, x3, y3, ymin);
+  for (uint8_t y = ymin; y <= ymax; y++) {
+    int16_t lo = xmin, hi = xmax;
+    clip_to_edge(&e12, s12, &lo, &hi);
+    clip_to_edge(&e13, !s12, &lo, &hi);
+    clip_to_edge(&e23, s12, &lo, &hi);
+    if (lo <= hi) fill_span(lo, hi, y, color);
+    e12.b += e12.step;
+    e13.b += e13.step;
+    e23.b += e23.step;
   }
 }
 
 void lcd_fillCircleSimple(uint8_t center_x, uint8_t center_y, int16_t radius,
                           uint8_t color) {
+  mark_dirty_rect(center_x - radius, center_y - radius, center_x + radius,
+                  center_y + radius);
   for (int16_t dx = -radius; dx <= radius; dx++) {
     for (int16_t dy = -radius; dy <= radius; dy++) {
       if (dx * dx + dy * dy < radius * radius) {
         if (center_x + dx >= DISPLAY_WIDTH || center_x + dx < 0 ||
             center_y + dy >= DISPLAY_HEIGHT || center_y + dy < 0)
           continue;
-        lcd_drawPixel(center_x + dx, center_y + dy, color);
+        put_pixel(center_x + dx, center_y + dy, color);
       }
     }
   }
@@ -435,3 +906,135 @@ void lcd_drawRect(uint8_t px1, uint8_t py1, uint8_t px2, uint8_t py2,
   lcd_drawLine(px2, py2, px1, py2, color);
   lcd_drawLine(px1, py2, px1, py1, color);
 }
+
+#ifdef CONFIG_TIMING_FUNCTIONS
+#define DRAW_BENCHMARK_ITERATIONS 100
+
+// reference implementation with one line per row, only for the benchmark
+static void fill_rect_lines(uint8_t px1, uint8_t py1, uint8_t px2,
+                            uint8_t py2, uint8_t color) {
+  for (uint8_t y = py1; y <= py2; y++) {
+    draw_line_pixels(px1, y, px2, y, color);
+  }
+}
+
+struct rect {
+  uint8_t x1, y1, x2, y2;
+};
+
+// reference implementation testing every pixel of the bounding box, with int
+// instead of int8_t intermediates, only for the benchmark
+static void fill_triangle_points(int16_t x1, int8_t y1, int16_t x2, int8_t y2,
+                                 int16_t x3, int8_t y3, uint8_t color) {
+  int16_t xmin = MAX(MIN(MIN(x1, x2), x3), 0);
+  int16_t xmax = MIN(MAX(MAX(x1, x2), x3), DISPLAY_WIDTH - 1);
+  int16_t ymin = MAX(MIN(MIN(y1, y2), y3), 0);
+  int16_t ymax = MIN(MAX(MAX(y1, y2), y3), DISPLAY_HEIGHT - 1);
+  for (int16_t x = xmin; x <= xmax; x++) {
+    for (int16_t y = ymin; y <= ymax; y++) {
+      int p1x = x - x1;
+      int p1y = y - y1;
+      uint8_t s12 = (x2 - x1) * p1y - (y2 - y1) * p1x > 0;
+      if (((x3 - x1) * p1y - (y3 - y1) * p1x > 0) == s12) continue;
+      if (((x3 - x2) * (y - y2) - (y3 - y2) * (x - x2) > 0) != s12) continue;
+      put_pixel(x, y, color);
+    }
+  }
+}
+
+struct triangle {
+  int16_t x1;
+  int8_t y1;
+  int16_t x2;
+  int8_t y2;
+  int16_t x3;
+  int8_t y3;
+};
+
+#define TRIANGLE_CHECKS 500
+
+static uint32_t xorshift(uint32_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+// compares the rasterizer with the reference on random, partly offscreen
+// triangles, returns the number of differing ones
+static int check_triangles(void) {
+  static uint8_t reference[DISPLAY_HEIGHT / 8][DISPLAY_WIDTH];
+  uint32_t state = 0x2545F491;
+  int n_differing = 0;
+  for (int i = 0; i < TRIANGLE_CHECKS; i++) {
+    struct triangle t = {
+        xorshift(&state) % 256 - 64, xorshift(&state) % 128 - 32,
+        xorshift(&state) % 256 - 64, xorshift(&state) % 128 - 32,
+        xorshift(&state) % 256 - 64, xorshift(&state) % 128 - 32};
+    lcd_clear_buffer();
+    fill_triangle_points(t.x1, t.y1, t.x2, t.y2, t.x3, t.y3, WHITE);
+    memcpy(reference, displayBuffer, sizeof(reference));
+    lcd_clear_buffer();
+    lcd_fillTriangle(t.x1, t.y1, t.x2, t.y2, t.x3, t.y3, WHITE);
+    if (memcmp(reference, displayBuffer, sizeof(reference))) {
+      printk("triangle (%d,%d) (%d,%d) (%d,%d) differs\n", t.x1, t.y1, t.x2,
+             t.y2, t.x3, t.y3);
+      n_differing++;
+    }
+  }
+  return n_differing;
+}
+
+void benchmark_drawing(void) {
+  // a tetris block, a breakout brick, a cleared area and the whole screen
+  const struct rect rects[] = {
+      {10, 10, 13, 13}, {1, 5, 20, 8}, {0, 8, 40, 16}, {0, 0, 127, 63}};
+  timing_start();
+  for (uint8_t i = 0; i < ARRAY_SIZE(rects); i++) {
+    struct rect r = rects[i];
+    timing_t start = timing_counter_get();
+    for (int j = 0; j < DRAW_BENCHMARK_ITERATIONS; j++) {
+      fill_rect_lines(r.x1, r.y1, r.x2, r.y2, j % 2);
+    }
+    timing_t end = timing_counter_get();
+    uint64_t line_cycles = timing_cycles_get(&start, &end);
+    start = timing_counter_get();
+    for (int j = 0; j < DRAW_BENCHMARK_ITERATIONS; j++) {
+      lcd_fillRect(r.x1, r.y1, r.x2, r.y2, j % 2);
+    }
+    end = timing_counter_get();
+    uint64_t span_cycles = timing_cycles_get(&start, &end);
+    printk("fill %dx%d: per row %llu cycles, spans %llu cycles\n",
+           r.x2 - r.x1 + 1, r.y2 - r.y1 + 1,
+           line_cycles / DRAW_BENCHMARK_ITERATIONS,
+           span_cycles / DRAW_BENCHMARK_ITERATIONS);
+  }
+
+  printk("triangles: %d of %d differ from the reference\n", check_triangles(),
+         TRIANGLE_CHECKS);
+  // a lander flame, half of the screen and one reaching past every border
+  const struct triangle triangles[] = {{60, 40, 66, 40, 63, 46},
+                                       {0, 0, 127, 0, 0, 63},
+                                       {-20, -10, 150, 20, 40, 80}};
+  for (uint8_t i = 0; i < ARRAY_SIZE(triangles); i++) {
+    struct triangle t = triangles[i];
+    timing_t start = timing_counter_get();
+    for (int j = 0; j < DRAW_BENCHMARK_ITERATIONS; j++) {
+      fill_triangle_points(t.x1, t.y1, t.x2, t.y2, t.x3, t.y3, j % 2);
+    }
+    timing_t end = timing_counter_get();
+    uint64_t point_cycles = timing_cycles_get(&start, &end);
+    start = timing_counter_get();
+    for (int j = 0; j < DRAW_BENCHMARK_ITERATIONS; j++) {
+      lcd_fillTriangle(t.x1, t.y1, t.x2, t.y2, t.x3, t.y3, j % 2);
+    }
+    end = timing_counter_get();
+    uint64_t span_cycles = timing_cycles_get(&start, &end);
+    printk("triangle %d: per pixel %llu cycles, spans %llu cycles\n", i,
+           point_cycles / DRAW_BENCHMARK_ITERATIONS,
+           span_cycles / DRAW_BENCHMARK_ITERATIONS);
+  }
+  timing_stop();
+  lcd_clear_buffer();
+}
+#endif
@@ -7,6 +7,12 @@
 #define DISPLAY_WIDTH 128
 #define DISPLAY_HEIGHT 64
 
+// Drawing functions remember the columns they changed and lcd_display()
+// only sends those that differ from the display. Code writing displayBuffer
+// directly calls lcd_mark_dirty(). Frames are sent in the background from a
+// copy, so drawing the next one can start right away. Functions that talk to
+// the display wait for that copy to be sent and must not be called from an
+// ISR or the system workqueue, which sends it.
 extern uint8_t displayBuffer[DISPLAY_HEIGHT / 8][DISPLAY_WIDTH];
 #define WHITE 0x01
 #define BLACK 0x00
@@ -16,7 +22,11 @@ void lcd_puts(const char* s);
 void lcd_puts_invert(const char* s);
 void lcd_gotoxy(uint8_t x, uint8_t y);
 void lcd_goto_xpix_y(uint8_t x, uint8_t y);
+// waits for the previous frame to be sent, then starts sending this one
 void lcd_display(void);
+// Starts sending the frame, or -EBUSY if the previous one is still being
+// sent. The changes of a dropped frame are sent with the next one.
+int lcd_display_async(void);
 void lcd_clear_buffer(void);
 void enable_display(void);
 void disable_display(void);
@@ -41,5 +51,24 @@ void lcd_fillCircleSimple(uint8_t center_x, uint8_t center_y, int16_t radius,
 void lcd_drawRect(uint8_t px1, uint8_t py1, uint8_t px2, uint8_t py2,
                   uint8_t color);
 uint8_t lcd_check_buffer(uint8_t x, uint8_t y);
+void lcd_mark_dirty(uint8_t x, uint8_t line, uint8_t width, uint8_t n_lines);
+
+struct display_stats {
+  uint32_t n_frames;          // lcd_display() calls
+  uint32_t n_bytes;           // sent over I2C, including addressing
+  uint32_t n_dropped;         // lcd_display_async() while busy
+  uint32_t n_errors;          // failed transfers
+  uint16_t bus_khz;
+  uint16_t last_frame_bytes;  // sent by the last lcd_display()
+};
+
+extern struct display_stats display_stats;
+
+// print full and partial frame flush times at 400kHz and 1MHz
+// (needs CONFIG_TIMING_FUNCTIONS)
+void benchmark_display(void);
+// print cycles of the drawing functions against their per pixel reference
+// (needs CONFIG_TIMING_FUNCTIONS)
+void benchmark_drawing(void);
 
 #endif  // DISPLAY_H
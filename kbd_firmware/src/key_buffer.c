@@ -0,0 +1,80 @@
+#include "key_buffer.h"
+
+#include <zephyr/sys/printk.h>
+#include <zephyr/toolchain.h>
+
+static struct key_event events[KEY_BUFFER_SIZE];
+static uint16_t head = 0;  // index of the oldest event
+static uint16_t n_events = 0;
+
+struct key_buffer_stats key_buffer_stats = {0};
+
+static struct key_event *event_at(uint16_t i) {
+  return &events[(head + i) % KEY_BUFFER_SIZE];
+}
+
+// Between two releases of a key there is a press of it, so a full buffer
+// always holds a press.
+BUILD_ASSERT(KEY_BUFFER_SIZE > MATRIX_ROWS * MATRIX_COLS,
+             "key buffer can fill up with releases");
+
+// Makes room for a release by dropping the oldest press. A lost press only
+// loses a keystroke, a lost release would leave the key active.
+static void discard_oldest_press() {
+  uint16_t i = 0;
+  while (!event_at(i)->pressed) {
+    i++;
+  }
+  for (; i + 1 < n_events; i++) {
+    *event_at(i) = *event_at(i + 1);
+  }
+  n_events--;
+  key_buffer_stats.n_discarded++;
+}
+
+void key_buffer_push(struct key_event event) {
+  // presses leave room for the releases of the keys held meanwhile
+  if (event.pressed &&
+      n_events >= KEY_BUFFER_SIZE - KEY_BUFFER_RELEASE_RESERVE) {
+    key_buffer_stats.n_discarded++;
+    return;
+  }
+  if (n_events == KEY_BUFFER_SIZE) {
+    discard_oldest_press();
+  }
+  *event_at(n_events++) = event;
+}
+
+bool key_buffer_pop(struct key_event *event) {
+  if (n_events == 0) {
+    return false;
+  }
+  *event = events[head];
+  head = (head + 1) % KEY_BUFFER_SIZE;
+  n_events--;
+  key_buffer_stats.n_replayed++;
+  return true;
+}
+
+bool key_buffer_empty() { return n_events == 0; }
+
+void key_buffer_expire(uint32_t now_ms) {
+  uint16_t i = 0;
+  while (i < n_events && !event_at(i)->pressed) {
+    i++;
+  }
+  if (i == n_events || now_ms - event_at(i)->time_ms < KEY_BUFFER_MAX_AGE_MS) {
+    return;
+  }
+  // the host took too long, a partial replay would only garble the input
+  uint16_t n_kept = 0;
+  for (i = 0; i < n_events; i++) {
+    if (event_at(i)->pressed) {
+      key_buffer_stats.n_discarded++;
+    } else {
+      *event_at(n_kept++) = *event_at(i);
+    }
+  }
+  printk("Discarded %d stale key presses\n", n_events - n_kept);
+  n_events = n_kept;
+}
@@ -0,0 +1,28 @@
+#ifndef KEY_BUFFER_H
+#define KEY_BUFFER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+// Key events recorded while the host can't receive reports (waking up,
+// reconnecting, encrypting the link) and replayed once it can, in order and
+// with their original timestamps. Only used by the main thread.
+
+struct key_buffer_stats {
+  uint32_t n_replayed;
+  uint32_t n_discarded;  // presses that were too old or found no room
+};
+
+extern struct key_buffer_stats key_buffer_stats;
+
+void key_buffer_push(struct key_event event);
+// returns false if the buffer is empty
+bool key_buffer_pop(struct key_event *event);
+bool key_buffer_empty();
+// Discards the recorded presses once the oldest one is older than
+// KEY_BUFFER_MAX_AGE_MS. Releases are kept so no key stays active.
+void key_buffer_expire(uint32_t now_ms);
+
+#endif  // KEY_BUFFER_H
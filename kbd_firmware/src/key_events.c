@@ -0,0 +1,96 @@
+#include "key_events.h"
+
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+
+#include "key_matrix.h"
+
+BUILD_ASSERT((KEY_EVENT_RING_SIZE & (KEY_EVENT_RING_SIZE - 1)) == 0,
+             "KEY_EVENT_RING_SIZE must be a power of 2");
+
+static struct key_event ring[KEY_EVENT_RING_SIZE];
+// number of events ever written, the slot of event i is i % size
+static atomic_t head = ATOMIC_INIT(0);
+
+atomic_t key_event_overflows = ATOMIC_INIT(0);
+
+static K_SEM_DEFINE(key_event_sem, 0, 1);
+// set by key_event_wake(), the waiting reader returns without an event
+static atomic_t wake_requested = ATOMIC_INIT(0);
+
+void key_event_push(struct key_event event) {
+  uint32_t h = atomic_get(&head);
+  ring[h % KEY_EVENT_RING_SIZE] = event;
+  // atomic_set is a full barrier, readers never see the new head before the
+  // event itself
+  atomic_set(&head, h + 1);
+  k_sem_give(&key_event_sem);
+}
+
+void key_event_reader_init(struct key_event_reader *reader,
+                           struct pressed_keys *keys) {
+  uint32_t h;
+  do {
+    h = atomic_get(&head);
+    if (keys) {
+      // the scanner updates the state before pushing the events, applying
+      // an event to a state that already contains it changes nothing
+      *keys = current_pressed_keys;
+    }
+  } while (h != (uint32_t)atomic_get(&head));
+  *reader = (struct key_event_reader){.tail = h};
+}
+
+int key_event_read(struct key_event_reader *reader, struct key_event *event) {
+  while (1) {
+    uint32_t h = atomic_get(&head);
+    if (reader->tail == h) {
+      return -EAGAIN;
+    }
+    // the slot after the newest event is the one being written next, so at
+    // most KEY_EVENT_RING_SIZE - 1 events can be read safely
+    if (h - reader->tail >= KEY_EVENT_RING_SIZE) {
+      uint32_t lost = h - reader->tail - (KEY_EVENT_RING_SIZE - 1);
+      reader->n_lost += lost;
+      atomic_add(&key_event_overflows, lost);
+      reader->tail += lost;
+    }
+    *event = ring[reader->tail % KEY_EVENT_RING_SIZE];
+    // retry if the producer overwrote the slot while we were copying it
+    if ((uint32_t)atomic_get(&head) - reader->tail >= KEY_EVENT_RING_SIZE) {
+      continue;
+    }
+    reader->tail++;
+    return 0;
+  }
+}
+
+int key_event_wait(struct key_event_reader *reader, struct key_event *event,
+                   int timeout_ms) {
+  int64_t end = k_uptime_get() + timeout_ms;
+  while (key_event_read(reader, event) != 0) {
+    int64_t remaining = end - k_uptime_get();
+    if (atomic_clear(&wake_requested) || remaining <= 0 ||
+        k_sem_take(&key_event_sem, K_MSEC(remaining)) != 0) {
+      return -EAGAIN;
+    }
+  }
+  return 0;
+}
+
+void key_event_wake(void) {
+  atomic_set(&wake_requested, 1);
+  k_sem_give(&key_event_sem);
+}
+
+void apply_key_event(struct pressed_keys *keys, struct key_event event) {
+  struct key_coord k = event.coord;
+  if (is_wake_key(k)) {
+    keys->wake_pressed = event.pressed;
+  } else if (event.pressed) {
+    keys->rows[k.row] |= 1 << k.col;
+  } else {
+    keys->rows[k.row] &= ~(1 << k.col);
+  }
+}
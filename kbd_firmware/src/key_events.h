@@ -0,0 +1,55 @@
+#ifndef KEY_EVENTS_H
+#define KEY_EVENTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <zephyr/sys/atomic.h>
+
+#include "config.h"
+
+// Ring of timestamped key events, written by the scan thread and read
+// independently by any number of readers (main, applications), each with
+// its own read position. The producer never blocks: a reader that falls more
+// than KEY_EVENT_RING_SIZE - 1 events behind loses the oldest ones, which is
+// counted in its n_lost and in key_event_overflows.
+#define KEY_EVENT_RING_SIZE 64
+
+// the wake button is reported with this coordinate
+#define WAKE_KEY ((struct key_coord){0xff, 0xff})
+
+static inline bool is_wake_key(struct key_coord key) {
+  return keq(key, WAKE_KEY);
+}
+
+struct key_event_reader {
+  uint32_t tail;  // index of the next event to read
+  uint32_t n_lost;
+};
+
+extern atomic_t key_event_overflows;
+
+// only called by the scan thread
+void key_event_push(struct key_event event);
+
+// Start reading at the newest event. If keys is not NULL it is set to the
+// current state, so applying all following events keeps it up to date.
+void key_event_reader_init(struct key_event_reader *reader,
+                           struct pressed_keys *keys);
+
+// returns 0 and the next event, or -EAGAIN if there is none
+int key_event_read(struct key_event_reader *reader, struct key_event *event);
+
+// as key_event_read, but wait up to timeout_ms for an event
+// (only one reader may wait at a time)
+int key_event_wait(struct key_event_reader *reader, struct key_event *event,
+                   int timeout_ms);
+
+// makes the waiting key_event_wait() return -EAGAIN, e.g. once the reports
+// it waits for were sent
+void key_event_wake(void);
+
+// apply a press/release to a pressed keys state
+void apply_key_event(struct pressed_keys *keys, struct key_event event);
+
+#endif  // KEY_EVENTS_H
@@ -1,20 +1,104 @@
 #include "key_layout.h"
 
 #include <stdint.h>
+#include <string.h>
+#include <zephyr/sys/atomic.h>
 #include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/toolchain.h>
 
 #include "config.h"
+#include "key_events.h"
 #include "key_matrix.h"
+#include "macros.h"
 #include "nvs.h"
 #include "usb_hid_keys.h"
 
-enum key_layer {
-  LAYER_0 = 0,
-  LAYER_2 = 2,
-  LAYER_3 = 3,
-  LAYER_5 = 5,
+enum key_action_type {
+  ACTION_KEY = 0,
+  ACTION_MOMENTARY,  // layer while held
+  ACTION_TOGGLE,     // toggle layer on press
+  ACTION_ONE_SHOT,   // layer for the next key press, or while held
+  ACTION_LAYER_TAP,  // layer while held, key when tapped
+  ACTION_MOD_TAP,    // modifiers while held, key when tapped
+  ACTION_MACRO,      // play a macro on press
 };
 
+struct key_action {
+  uint8_t key;    // HID key code, tap key for tap-hold actions, macro index
+  uint8_t mod;    // Modifier key mask (e.g., KEY_MOD_LCTRL)
+  uint8_t type;   // enum key_action_type
+  uint8_t layer;  // enum key_layer for layer actions
+};
+
+// keys pressed together that act as a single key
+struct combo {
+  matrix_row_t keys[MATRIX_ROWS];
+  struct key_action action;
+};
+
+// generated from layout.keymap by scripts/gen_keymap.py: enum key_layer,
+// key_map with the layer 0 fallback already applied, combos and macros
+#include "keymap_table.h"
+
+BUILD_ASSERT(KEYMAP_ROWS == MATRIX_ROWS && KEYMAP_COLS == MATRIX_COLS,
+             "layout.keymap does not match the key matrix");
+BUILD_ASSERT(KEYMAP_N_LAYERS <= 8, "layer masks are 8 bit");
+BUILD_ASSERT(KEYMAP_N_COMBOS <= 32, "combo masks are 32 bit");
+BUILD_ASSERT(KEYMAP_COMBO_MAX_KEYS <= COMBO_MAX_KEYS,
+             "combo with more than COMBO_MAX_KEYS keys");
+// an undecided tap-hold key keeps the scanner in its periodic tiers, so a
+// release deciding a tap is seen within one scan period
+BUILD_ASSERT(TAPPING_TERM_MS <= SCAN_HOLD_AFTER_MS,
+             "tap-hold releases would be polled slowly");
+
+// active layers, one bit per enum key_layer, the highest bit wins
+struct layer_state {
+  uint8_t momentary;  // held MO, OSL and LT keys
+  uint8_t toggled;
+  uint8_t oneshot;  // cleared by the next key, see consume_oneshot()
+  // several keys can hold a layer, it stays on until the last one is released
+  uint8_t holders[KEYMAP_N_LAYERS];
+};
+
+static struct layer_state layer_state = {0};
+
+// A pressed tap-hold key waiting for its decision. Later events are held back
+// and replayed once it is decided, so they see the right layer & modifiers.
+static struct {
+  bool undecided;
+  struct key_event press;
+  enum key_layer layer;
+  struct key_event held_back[TAP_HOLD_BUFFER_SIZE];
+  uint8_t n_held_back;
+} tap_hold = {0};
+
+// Presses of combo keys are held back while they can still form a combo,
+// until COMBO_TERM_MS after the first one at the latest.
+static struct {
+  matrix_row_t keys[MATRIX_ROWS];
+  struct key_event held_back[KEYMAP_COMBO_MAX_KEYS];
+  uint8_t n_held_back;
+} combo_pending = {0};
+
+// pressed combos, their keys are consumed until they are released
+static uint32_t active_combos = 0;
+static matrix_row_t combo_consumed[MATRIX_ROWS] = {0};
+
+struct combo_stats combo_stats = {0};
+
+enum tap_hold_decision {
+  TAP_HOLD_UNDECIDED,
+  TAP_HOLD_TAP,
+  TAP_HOLD_HOLD,
+};
+
+// reports generated by the processed events, drained with pop_key_report()
+// after every event. The main loop processes no events while reports are left.
+static struct encoded_keys key_reports[KEY_REPORT_BURST];
+static uint8_t n_key_reports = 0;
+static uint8_t first_key_report = 0;
+
 // key with active layer at the time it was pressed
 
 /*
@@ -35,355 +119,452 @@ struct key_with_layer {
   enum key_layer layer;
 };
 
+// what an active key or combo adds to the report, fixed when it is pressed
+struct reported_key {
+  uint8_t key;
+  uint8_t mod;
+};
+
 // state of currently active keys
 struct active_keys_state {
-  struct key_with_layer keys[MAX_N_PRESSED_KEYS];
-  uint8_t n_active;  // number of active keys
+  matrix_row_t active[MATRIX_ROWS];
+  // tap-hold keys decided as tap, they report their tap key
+  matrix_row_t tapped[MATRIX_ROWS];
+  // only valid for active keys
+  enum key_layer layers[MATRIX_ROWS][MATRIX_COLS];
+  struct reported_key reported[MATRIX_ROWS][MATRIX_COLS];
 };
 
 struct active_keys_state current_active_keys = {0};
+static struct reported_key reported_combos[MAX(KEYMAP_N_COMBOS, 1)];
 
-struct key_with_mod {
-  uint8_t key;  // HID key code
-  uint8_t mod;  // Modifier key mask (e.g., KEY_MOD_LCTRL)
-};
-
-struct key_coord layer_2_key = {3, 7};
-struct key_coord layer_3_key = {3, 6};
-struct key_coord layer_5_key = {3, 1};
-
-struct key_with_mod key_map_layer_0[4][11] = {
-    {
-        {KEY_X, 0},
-        {KEY_V, 0},
-        {KEY_L, 0},
-        {KEY_C, 0},
-        {KEY_W, 0},
-        {KEY_Z, 0},
-        {KEY_K, 0},
-        {KEY_H, 0},
-        {KEY_G, 0},
-        {KEY_F, 0},
-        {KEY_Q, 0},
-    },
-    {
-        {KEY_U, 0},
-        {KEY_I, 0},
-        {KEY_A, 0},
-        {KEY_E, 0},
-        {KEY_O, 0},
-        {KEY_LEFTCTRL, KEY_MOD_LCTRL},
-        {KEY_S, 0},
-        {KEY_N, 0},
-        {KEY_R, 0},
-        {KEY_T, 0},
-        {KEY_D, 0},
-    },
-    {
-        {KEY_LEFTSHIFT, KEY_MOD_LSHIFT},
-        {KEY_3, KEY_MOD_LSHIFT},
-        {KEY_Y, 0},
-        {KEY_P, 0},
-        {KEY_TAB, 0},
-        {0, 0},
-        {KEY_B, 0},
-        {KEY_M, 0},
-        {KEY_COMMA, 0},
-        {KEY_DOT, 0},
-        {KEY_J, 0},
-    },
-    {
-        {KEY_ESC, 0},
-        {KEY_FN, 0},
-        {0, 0},
-        {KEY_BACKSPACE, 0},
-        {KEY_SPACE, 0},
-        {KEY_LEFTMETA, KEY_MOD_LMETA},
-        {0, 0},
-        {0, 0},
-        {KEY_LEFTALT, KEY_MOD_LALT},
-        {KEY_GRAVE, 0},
-        {KEY_ENTER, 0},
-    },
-};
+// The report is updated one key at a time instead of being rebuilt from the
+// active keys. Several keys can report the same usage or modifier, so the
+// keys reporting each one are counted.
+static struct encoded_keys current_report = {0};
+static uint8_t usage_refs[NKRO_N_USAGES] = {0};
+static uint8_t mod_refs[8] = {0};
 
-struct key_with_mod key_map_layer_2[4][11] = {
-    {
-        {KEY_PAGEUP, 0},
-        {KEY_BACKSPACE, 0},
-        {KEY_UP, 0},
-        {KEY_DELETE, 0},
-        {KEY_PAGEDOWN, 0},
-        {0, 0},
-        {0, 0},
-        {KEY_7, 0},
-        {KEY_8, 0},
-        {KEY_9, 0},
-        {0, 0},
-    },
-    {
-        {KEY_HOME, 0},
-        {KEY_LEFT, 0},
-        {KEY_DOWN, 0},
-        {KEY_RIGHT, 0},
-        {KEY_END, 0},
-        {0, 0},
-        {0, 0},
-        {KEY_4, 0},
-        {KEY_5, 0},
-        {KEY_6, 0},
-        {0, 0},
-    },
-    {
-        {0, 0},
-        {0, 0},
-        {KEY_3, KEY_MOD_LSHIFT},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {KEY_1, 0},
-        {KEY_2, 0},
-        {KEY_3, 0},
-        {0, 0},
-    },
-    {
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {KEY_0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-    },
-};
+bool ctrl_cmd_swapped = false;
+// set by reload_key_layout(), the main thread reloads the settings
+static atomic_t reload_requested = ATOMIC_INIT(0);
 
-struct key_with_mod key_map_layer_3[4][11] = {
-    {
-        {KEY_2, KEY_MOD_LSHIFT},
-        {KEY_MINUS, KEY_MOD_LSHIFT},
-        {KEY_LEFTBRACE, 0},
-        {KEY_RIGHTBRACE, 0},
-        {KEY_6, KEY_MOD_LSHIFT},
-        {0, 0},
-        {KEY_1, KEY_MOD_LSHIFT},
-        {KEY_COMMA, KEY_MOD_LSHIFT},
-        {KEY_DOT, KEY_MOD_LSHIFT},
-        {KEY_EQUAL, 0},
-        {KEY_7, KEY_MOD_LSHIFT},
-    },
-    {
-        {KEY_BACKSLASH, 0},
-        {KEY_SLASH, 0},
-        {KEY_LEFTBRACE, KEY_MOD_LSHIFT},
-        {KEY_RIGHTBRACE, KEY_MOD_RSHIFT},
-        {KEY_8, KEY_MOD_LSHIFT},
-        {0},
-        {KEY_SLASH, KEY_MOD_LSHIFT},  // ?
-        {KEY_9, KEY_MOD_LSHIFT},      // (
-        {KEY_0, KEY_MOD_LSHIFT},      // )
-        {KEY_MINUS, 0},
-        {KEY_SEMICOLON, KEY_MOD_LSHIFT},  // :
-    },
-    {
-        {0, 0},
-        {0, 0},
-        {KEY_4, KEY_MOD_LSHIFT},          // $
-        {KEY_BACKSLASH, KEY_MOD_LSHIFT},  // |
-        {KEY_GRAVE, KEY_MOD_LSHIFT},      // ~
-        {KEY_GRAVE, 0},
-        {KEY_KPPLUS, 0},                   // +
-        {KEY_5, KEY_MOD_LSHIFT},           // %
-        {KEY_APOSTROPHE, KEY_MOD_LSHIFT},  // "
-        {KEY_APOSTROPHE, 0},
-        {KEY_SEMICOLON, 0},
-    },
-    {{0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}},
-};
+static enum key_layer get_active_layer() {
+  uint8_t active = BIT(LAYER_0) | layer_state.momentary |
+                   layer_state.toggled | layer_state.oneshot;
+  return 31 - __builtin_clz(active);
+}
 
-struct key_with_mod key_map_layer_5[4][11] = {
-    {
-        {KEY_F1, 0},
-        {KEY_F2, 0},
-        {KEY_F3, 0},
-        {KEY_F4, 0},
-        {KEY_F5, 0},
-        {0, 0},
-        {KEY_F6, 0},
-        {KEY_F7, 0},
-        {KEY_F8, 0},
-        {KEY_F9, 0},
-        {KEY_F10, 0},
-    },
-    {
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {KEY_F11, 0},
-    },
-    {
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {0, 0},
-        {KEY_F12, 0},
-    },
-    {{0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}},
-};
+static inline struct key_action get_key_action(struct key_with_layer key) {
+  return key_map[ctrl_cmd_swapped][key.layer][key.coord.row][key.coord.col];
+}
 
-enum key_layer get_active_layer(struct pressed_keys keys) {
-  if (keys.n_pressed == 0) {
-    return LAYER_0;  // Default layer
-  }
-
-  // Check for specific keys to determine the active layer
-  for (uint8_t i = 0; i < keys.n_pressed; i++) {
-    if (keys.keys[i].row == layer_2_key.row &&
-        keys.keys[i].col == layer_2_key.col) {
-      return LAYER_2;
-    } else if (keys.keys[i].row == layer_3_key.row &&
-               keys.keys[i].col == layer_3_key.col) {
-      return LAYER_3;
-    } else if (keys.keys[i].row == layer_5_key.row &&
-               keys.keys[i].col == layer_5_key.col) {
-      return LAYER_5;
+static void update_report(struct reported_key r, bool pressed) {
+  int8_t delta = pressed ? 1 : -1;
+  if (r.key != 0 && r.key < NKRO_N_USAGES) {
+    usage_refs[r.key] += delta;
+    encoded_keys_set(&current_report, r.key, usage_refs[r.key] > 0);
+  }
+  for (uint8_t mods = r.mod; mods; mods &= mods - 1) {
+    uint8_t bit = __builtin_ctz(mods);
+    mod_refs[bit] += delta;
+    if (mod_refs[bit] > 0) {
+      current_report.modifier_mask |= BIT(bit);
+    } else {
+      current_report.modifier_mask &= ~BIT(bit);
     }
   }
+}
+
+static struct reported_key get_reported_key(struct key_action action,
+                                            bool tapped) {
+  if (tapped) {
+    return (struct reported_key){
+        action.key, action.type == ACTION_LAYER_TAP ? action.mod : 0};
+  }
+  switch (action.type) {
+    case ACTION_KEY:
+      return (struct reported_key){action.key, action.mod};
+    case ACTION_MOD_TAP:
+      return (struct reported_key){0, action.mod};
+    default:
+      return (struct reported_key){0};
+  }
+}
+
+static void queue_key_report() {
+  if (first_key_report == n_key_reports) {
+    n_key_reports = first_key_report = 0;
+  }
+  if (n_key_reports == KEY_REPORT_BURST) {
+    // not expected, the last report takes the newest state so no key stays
+    // pressed
+    printk("Key report queue full, merging\n");
+    key_reports[n_key_reports - 1] = get_encoded_keys();
+    return;
+  }
+  key_reports[n_key_reports++] = get_encoded_keys();
+}
+
+bool next_key_report(struct encoded_keys *report) {
+  if (first_key_report == n_key_reports) {
+    n_key_reports = first_key_report = 0;
+    return false;
+  }
+  *report = key_reports[first_key_report];
+  return true;
+}
+
+void pop_key_report() {
+  if (first_key_report < n_key_reports) {
+    first_key_report++;
+  }
+}
+
+void report_current_keys() { queue_key_report(); }
+
+static void hold_layer(enum key_layer layer) {
+  layer_state.holders[layer]++;
+  layer_state.momentary |= BIT(layer);
+}
+
+static void release_layer(enum key_layer layer) {
+  if (layer_state.holders[layer] > 0 && --layer_state.holders[layer] == 0) {
+    layer_state.momentary &= ~BIT(layer);
+  }
+}
 
-  return LAYER_0;  // Default to layer 0 if no special keys are pressed
+// every key that outputs something uses up a one-shot layer
+static void consume_oneshot() { layer_state.oneshot = 0; }
+
+static void press_key_action(struct key_action action) {
+  switch (action.type) {
+    case ACTION_KEY:
+      consume_oneshot();
+      break;
+    case ACTION_ONE_SHOT:
+      layer_state.oneshot |= BIT(action.layer);
+      // fall through
+    case ACTION_MOMENTARY:
+    case ACTION_LAYER_TAP:
+      hold_layer(action.layer);
+      break;
+    case ACTION_TOGGLE:
+      layer_state.toggled ^= BIT(action.layer);
+      break;
+    case ACTION_MOD_TAP:
+      break;
+    case ACTION_MACRO:
+      consume_oneshot();
+      play_macro(&macros[ctrl_cmd_swapped][action.key]);
+      break;
+  }
 }
 
-struct key_with_mod get_key_with_mod(struct key_with_layer key) {
-  struct key_with_mod res = {0, 0};
-  switch (key.layer) {
-    case LAYER_0:
-      return key_map_layer_0[key.coord.row][key.coord.col];
-    case LAYER_2:
-      res = key_map_layer_2[key.coord.row][key.coord.col];
+static void release_key_action(struct key_action action, bool tapped) {
+  switch (action.type) {
+    case ACTION_MOMENTARY:
+    case ACTION_ONE_SHOT:
+      release_layer(action.layer);
       break;
-    case LAYER_3:
-      res = key_map_layer_3[key.coord.row][key.coord.col];
+    case ACTION_LAYER_TAP:
+      if (!tapped) {
+        release_layer(action.layer);
+      }
       break;
-    case LAYER_5:
-      res = key_map_layer_5[key.coord.row][key.coord.col];
+    default:
       break;
   }
-  if (res.key == 0) {
-    return key_map_layer_0[key.coord.row][key.coord.col];  // Fallback to layer
-                                                           // 0 if no key found
+}
+
+static void activate_key(struct key_coord k, enum key_layer layer,
+                         bool tapped) {
+  current_active_keys.active[k.row] |= 1 << k.col;
+  if (tapped) {
+    current_active_keys.tapped[k.row] |= 1 << k.col;
   }
-  return res;
+  current_active_keys.layers[k.row][k.col] = layer;
+  struct key_action action = get_key_action((struct key_with_layer){k, layer});
+  struct reported_key r = get_reported_key(action, tapped);
+  current_active_keys.reported[k.row][k.col] = r;
+  update_report(r, true);
 }
 
-void update_active_keys_state() {
-  // update active keys state based on currently pressed keys
+static void apply_press(struct key_event event) {
+  // the layer is fixed at press time, see above
+  enum key_layer layer = get_active_layer();
+  struct key_action action =
+      get_key_action((struct key_with_layer){event.coord, layer});
+  if (action.type == ACTION_LAYER_TAP || action.type == ACTION_MOD_TAP) {
+    // nothing to report until it is decided
+    tap_hold.undecided = true;
+    tap_hold.press = event;
+    tap_hold.layer = layer;
+    tap_hold.n_held_back = 0;
+    return;
+  }
+  activate_key(event.coord, layer, false);
+  press_key_action(action);
+  queue_key_report();
+}
 
-  struct pressed_keys keys = current_pressed_keys;
-  enum key_layer current_layer = get_active_layer(keys);
+static void apply_release(struct key_event event) {
+  struct key_coord k = event.coord;
+  if (!(current_active_keys.active[k.row] & (1 << k.col))) {
+    return;  // the press wasn't processed, e.g. while an application ran
+  }
+  bool tapped = current_active_keys.tapped[k.row] & (1 << k.col);
+  current_active_keys.active[k.row] &= ~(1 << k.col);
+  current_active_keys.tapped[k.row] &= ~(1 << k.col);
+  update_report(current_active_keys.reported[k.row][k.col], false);
+  release_key_action(get_key_action((struct key_with_layer){
+                         k, current_active_keys.layers[k.row][k.col]}),
+                     tapped);
+  queue_key_report();
+}
 
-  struct active_keys_state new_active_keys = {0};
-  // keep all the keys that are still pressed
-  for (uint8_t i = 0; i < current_active_keys.n_active; i++) {
-    bool still_pressed = false;
-    for (uint8_t j = 0; j < keys.n_pressed; j++) {
-      if (keq(current_active_keys.keys[i].coord, keys.keys[j])) {
-        still_pressed = true;
-        break;
+static enum tap_hold_decision decide_tap_hold(struct key_event event) {
+  if (event.time_ms - tap_hold.press.time_ms >= TAPPING_TERM_MS) {
+    return TAP_HOLD_HOLD;
+  }
+  if (keq(event.coord, tap_hold.press.coord)) {
+    return TAP_HOLD_TAP;  // released within the tapping term
+  }
+  if (event.pressed && TAP_HOLD_ON_OTHER_KEY_PRESS) {
+    return TAP_HOLD_HOLD;
+  }
+  if (!event.pressed && TAP_HOLD_PERMISSIVE_HOLD) {
+    // another key was tapped while the tap-hold key is held
+    for (uint8_t i = 0; i < tap_hold.n_held_back; i++) {
+      if (keq(tap_hold.held_back[i].coord, event.coord)) {
+        return TAP_HOLD_HOLD;
       }
     }
-    if (still_pressed) {
-      new_active_keys.keys[new_active_keys.n_active] =
-          current_active_keys.keys[i];
-      new_active_keys.n_active++;
+  }
+  if (tap_hold.n_held_back == TAP_HOLD_BUFFER_SIZE) {
+    return TAP_HOLD_HOLD;
+  }
+  return TAP_HOLD_UNDECIDED;
+}
+
+static void handle_event(struct key_event event);
+
+static void resolve_tap_hold(enum tap_hold_decision decision) {
+  struct key_coord k = tap_hold.press.coord;
+  bool tapped = decision == TAP_HOLD_TAP;
+  tap_hold.undecided = false;
+  activate_key(k, tap_hold.layer, tapped);
+  if (tapped) {
+    consume_oneshot();
+  } else {
+    press_key_action(
+        get_key_action((struct key_with_layer){k, tap_hold.layer}));
+  }
+  queue_key_report();
+
+  // replaying may start a new tap-hold key, which holds back the rest again
+  uint8_t n_held_back = tap_hold.n_held_back;
+  struct key_event held_back[TAP_HOLD_BUFFER_SIZE];
+  memcpy(held_back, tap_hold.held_back, n_held_back * sizeof(held_back[0]));
+  for (uint8_t i = 0; i < n_held_back; i++) {
+    handle_event(held_back[i]);
+  }
+}
+
+static void handle_event(struct key_event event) {
+  if (!tap_hold.undecided) {
+    if (event.pressed) {
+      apply_press(event);
+    } else {
+      apply_release(event);
     }
+    return;
+  }
+  enum tap_hold_decision decision = decide_tap_hold(event);
+  if (decision == TAP_HOLD_UNDECIDED) {
+    tap_hold.held_back[tap_hold.n_held_back++] = event;
+    return;
   }
+  resolve_tap_hold(decision);
+  handle_event(event);
+}
 
-  // add new pressed keys
-  for (uint8_t i = 0; i < keys.n_pressed; i++) {
-    bool new_pressed = true;
-    for (uint8_t j = 0; j < new_active_keys.n_active; j++) {
-      if (keq(new_active_keys.keys[j].coord, keys.keys[i])) {
-        new_pressed = false;
-        break;
-      }
+static void count_key_press(uint32_t delay_ms) {
+  combo_stats.n_presses++;
+  combo_stats.total_delay_ms += delay_ms;
+  combo_stats.max_delay_ms = MAX(combo_stats.max_delay_ms, delay_ms);
+}
+
+// Index of the combo made of exactly keys, or -1. more is set if a combo
+// with more keys could still match.
+static int find_combo(const matrix_row_t keys[MATRIX_ROWS], bool *more) {
+  int match = -1;
+  *more = false;
+  for (uint8_t i = 0; i < KEYMAP_N_COMBOS; i++) {
+    const struct combo *c = &combos[ctrl_cmd_swapped][i];
+    matrix_row_t missing = 0;
+    matrix_row_t extra = 0;
+    for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+      missing |= c->keys[row] & ~keys[row];
+      extra |= keys[row] & ~c->keys[row];
+    }
+    if (extra) {
+      continue;
     }
-    if (new_pressed && new_active_keys.n_active < MAX_N_PRESSED_KEYS) {
-      // Add new key to active keys state
-      new_active_keys.keys[new_active_keys.n_active].coord = keys.keys[i];
-      new_active_keys.keys[new_active_keys.n_active].layer = current_layer;
-      new_active_keys.n_active++;
+    if (missing) {
+      *more = true;
+    } else {
+      match = i;
     }
   }
-  current_active_keys = new_active_keys;
+  return match;
 }
 
-struct encoded_keys get_encoded_keys() {
-  update_active_keys_state();
-
-  struct encoded_keys encoded = {0};
-  uint8_t n_keys = 0;
-  for (uint8_t i = 0; i < current_active_keys.n_active; i++) {
-    struct key_with_mod k_mod = get_key_with_mod(current_active_keys.keys[i]);
-    if (k_mod.key != 0) {
-      if (n_keys < MAX_N_ENCODED_KEYS) {
-        encoded.keys[n_keys] = k_mod.key;
-        encoded.modifier_mask |= k_mod.mod;
-        n_keys++;
-      } else {
-        // Set all keys to KEY_ERR_OVF if overflow occurs
-        for (uint8_t j = 0; j < MAX_N_ENCODED_KEYS; j++) {
-          encoded.keys[j] = KEY_ERR_OVF;
-        }
-        break;
-      }
+static void press_combo(uint8_t i) {
+  // a combo is another key press for an undecided tap-hold key
+  if (tap_hold.undecided) {
+    resolve_tap_hold(TAP_HOLD_HOLD);
+  }
+  active_combos |= BIT(i);
+  consume_oneshot();
+  struct key_action action = combos[ctrl_cmd_swapped][i].action;
+  reported_combos[i] = (struct reported_key){action.key, action.mod};
+  update_report(reported_combos[i], true);
+  for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+    combo_consumed[row] |= combo_pending.keys[row];
+  }
+  queue_key_report();
+}
+
+// the held back keys either form a combo or are processed as single keys
+static void end_combo_pending(uint32_t time_ms) {
+  uint8_t n_held_back = combo_pending.n_held_back;
+  struct key_event held_back[KEYMAP_COMBO_MAX_KEYS];
+  memcpy(held_back, combo_pending.held_back,
+         n_held_back * sizeof(held_back[0]));
+  for (uint8_t i = 0; i < n_held_back; i++) {
+    count_key_press(time_ms - held_back[i].time_ms);
+  }
+
+  bool more;
+  int match = find_combo(combo_pending.keys, &more);
+  if (match >= 0) {
+    press_combo(match);
+  }
+  memset(&combo_pending, 0, sizeof(combo_pending));
+  if (match < 0) {
+    for (uint8_t i = 0; i < n_held_back; i++) {
+      handle_event(held_back[i]);
     }
   }
-  return encoded;
 }
 
-bool ctrl_cmd_swapped = false;
+static void release_combo_key(struct key_coord k) {
+  combo_consumed[k.row] &= ~(1 << k.col);
+  // the first released key releases the combo, the others are ignored
+  uint32_t active = active_combos;
+  while (active) {
+    uint8_t i = __builtin_ctz(active);
+    active &= active - 1;
+    if (combos[ctrl_cmd_swapped][i].keys[k.row] & (1 << k.col)) {
+      active_combos &= ~BIT(i);
+      update_report(reported_combos[i], false);
+      queue_key_report();
+    }
+  }
+}
+
+void process_key_event(struct key_event event) {
+  struct key_coord k = event.coord;
+  if (!event.pressed && (combo_consumed[k.row] & (1 << k.col))) {
+    release_combo_key(k);
+    return;
+  }
+  if (combo_pending.n_held_back == 0) {
+    if (event.pressed && (combo_keys[k.row] & (1 << k.col))) {
+      combo_pending.keys[k.row] |= 1 << k.col;
+      combo_pending.held_back[combo_pending.n_held_back++] = event;
+      return;
+    }
+    if (event.pressed) {
+      count_key_press(0);
+    }
+    handle_event(event);
+    return;
+  }
 
-void swap_ctrl_cmd_in_keymap() {
-  // Swap Ctrl and Cmd keys in the key map
-  for (int row = 0; row < 4; row++) {
-    for (int col = 0; col < 11; col++) {
-      if (key_map_layer_0[row][col].key == KEY_LEFTCTRL) {
-        key_map_layer_0[row][col].key = KEY_LEFTMETA;
-        key_map_layer_0[row][col].mod = KEY_MOD_LMETA;
-      } else if (key_map_layer_0[row][col].key == KEY_LEFTMETA) {
-        key_map_layer_0[row][col].key = KEY_LEFTCTRL;
-        key_map_layer_0[row][col].mod = KEY_MOD_LCTRL;
+  uint32_t first_ms = combo_pending.held_back[0].time_ms;
+  if (event.time_ms - first_ms >= COMBO_TERM_MS) {
+    // the combo window closed before this event
+    end_combo_pending(first_ms + COMBO_TERM_MS);
+  } else if (event.pressed) {
+    matrix_row_t keys[MATRIX_ROWS];
+    memcpy(keys, combo_pending.keys, sizeof(keys));
+    keys[k.row] |= 1 << k.col;
+    bool more;
+    int match = find_combo(keys, &more);
+    if (match >= 0 || more) {
+      combo_pending.keys[k.row] |= 1 << k.col;
+      combo_pending.held_back[combo_pending.n_held_back++] = event;
+      if (!more) {
+        end_combo_pending(event.time_ms);
       }
+      return;
     }
+    // no combo can match any more, don't wait for the window to close
+    end_combo_pending(event.time_ms);
+  } else {
+    // releases aren't held back, end the combo first to keep the order
+    end_combo_pending(event.time_ms);
   }
+  process_key_event(event);
 }
 
+static uint32_t deadline_ms(uint32_t start_ms, uint32_t term_ms,
+                            uint32_t now_ms) {
+  int32_t elapsed_ms = now_ms - start_ms;
+  return MAX((int32_t)term_ms - elapsed_ms, 0);
+}
+
+int32_t key_layout_timeout_ms(uint32_t now_ms) {
+  if (combo_pending.n_held_back > 0) {
+    // a pending tap-hold key is decided after the combo
+    return deadline_ms(combo_pending.held_back[0].time_ms, COMBO_TERM_MS,
+                       now_ms);
+  }
+  if (tap_hold.undecided) {
+    return deadline_ms(tap_hold.press.time_ms, TAPPING_TERM_MS, now_ms);
+  }
+  return -1;
+}
+
+void process_key_timeout(uint32_t now_ms) {
+  if (combo_pending.n_held_back > 0 &&
+      now_ms - combo_pending.held_back[0].time_ms >= COMBO_TERM_MS) {
+    end_combo_pending(now_ms);
+  }
+  if (tap_hold.undecided &&
+      now_ms - tap_hold.press.time_ms >= TAPPING_TERM_MS) {
+    resolve_tap_hold(TAP_HOLD_HOLD);
+  }
+}
+
+struct encoded_keys get_encoded_keys() { return current_report; }
+
 void swap_ctrl_cmd() {
   ctrl_cmd_swapped = !ctrl_cmd_swapped;
-  swap_ctrl_cmd_in_keymap();
   nvs_store_ctrl_cmd(ctrl_cmd_swapped);
 }
 
-void init_key_layout() {
-  if (nvs_get_ctrl_cmd_config() != ctrl_cmd_swapped) {
-    ctrl_cmd_swapped = !ctrl_cmd_swapped;
-    swap_ctrl_cmd_in_keymap();
+void init_key_layout() { ctrl_cmd_swapped = nvs_get_ctrl_cmd_config(); }
+
+void reload_key_layout() {
+  atomic_set(&reload_requested, 1);
+  key_event_wake();
+}
+
+void update_key_layout() {
+  if (atomic_clear(&reload_requested)) {
+    init_key_layout();
   }
 }
@@ -5,12 +5,40 @@
 
 #include "config.h"
 
+// Update the active keys and layers with a press/release. Combo keys and
+// events after an undecided tap-hold key are held back until they are
+// decided, so one event can produce none or several reports, see
+// next_key_report().
+void process_key_event(struct key_event event);
+// decide combos and tap-hold keys whose time window expired
+void process_key_timeout(uint32_t now_ms);
+// time until process_key_timeout() has to be called, -1 if not needed
+int32_t key_layout_timeout_ms(uint32_t now_ms);
+// next report to send to the host, in order, false if there is none
+bool next_key_report(struct encoded_keys *report);
+// removes the report returned by next_key_report() once it was sent
+void pop_key_report();
+// queues a report with the current state, e.g. after reports were discarded
+void report_current_keys();
 struct encoded_keys get_encoded_keys();
-bool eq_pressed_keys(struct pressed_keys a, struct pressed_keys b);
+
+// delay added to key presses by holding them back for combos
+struct combo_stats {
+  uint32_t n_presses;
+  uint32_t total_delay_ms;
+  uint32_t max_delay_ms;
+};
+
+extern struct combo_stats combo_stats;
 
 extern bool ctrl_cmd_swapped;
 void swap_ctrl_cmd();
 
 void init_key_layout();
+// Asks the main loop to load the settings of the current host slot again,
+// from any thread. The layout is only used by the main thread, which applies
+// it with update_key_layout().
+void reload_key_layout();
+void update_key_layout();
 
 #endif  // KEY_LAYOUT_H
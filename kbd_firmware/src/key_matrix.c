@@ -1,15 +1,36 @@
 
 #include "key_matrix.h"
 
+#include <errno.h>
+#include <stdlib.h>
 #include <zephyr/device.h>
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/kernel.h>
 #include <zephyr/sys/util.h>
+#include <zephyr/timing/timing.h>
+
+#include "debounce.h"
+#include "key_events.h"
 
 #define ZEPHYR_USER_NODE DT_PATH(zephyr_user)
 
+#define SCAN_THREAD_STACK_SIZE 1024
+// cooperative, a scan is short and shouldn't be preempted while a column is
+// driven
+#define SCAN_THREAD_PRIORITY -1
+#define SCAN_STATS_WINDOW_MS 1000
+
 struct pressed_keys current_pressed_keys = {0};
-struct pressed_keys last_pressed_keys = {0};
+static struct pressed_keys last_pressed_keys = {0};
+
+struct scan_stats scan_stats = {0};
+
+K_THREAD_STACK_DEFINE(scan_thread_stack, SCAN_THREAD_STACK_SIZE);
+struct k_thread scan_thread_data;
+
+static K_TIMER_DEFINE(scan_timer, NULL, NULL);
+
+static void scan_thread(void *p1, void *p2, void *p3);
 
 const struct gpio_dt_spec gpio_rows[] = {
     GPIO_DT_SPEC_GET(ZEPHYR_USER_NODE, r0_gpios),
@@ -55,6 +76,17 @@ static inline void enable_row_interrupts() {
     gpio_pin_interrupt_configure(wake_btn.port, i, GPIO_INT_LEVEL_ACTIVE);
   }
 }
+
+// Rows with level interrupts, wake button on both edges (it may be the key
+// that is held). Only used in held mode, where columns with held keys are
+// not driven, so the rows stay low until a key in another column is pressed.
+static inline void enable_held_interrupts() {
+  for (int i = 0; i < ARRAY_SIZE(gpio_rows); i++) {
+    gpio_pin_interrupt_configure_dt(&gpio_rows[i], GPIO_INT_LEVEL_ACTIVE);
+  }
+  gpio_pin_interrupt_configure_dt(&wake_btn, GPIO_INT_EDGE_BOTH);
+}
+
 // Interrupt handler function
 static void gpio_isr_callback(const struct device *dev,
                               struct gpio_callback *callback, uint32_t pins) {
@@ -81,53 +113,319 @@ void init_key_matrix(void) {
   for (int i = 0; i < ARRAY_SIZE(gpio_cols); i++) {
     gpio_pin_configure_dt(&gpio_cols[i], GPIO_OUTPUT | GPIO_ACTIVE_HIGH);
   }
+
+  k_thread_create(&scan_thread_data, scan_thread_stack,
+                  K_THREAD_STACK_SIZEOF(scan_thread_stack), scan_thread, NULL,
+                  NULL, NULL, SCAN_THREAD_PRIORITY, 0, K_NO_WAIT);
+}
+
+// Sample the whole matrix into raw_rows, driving the columns and reading the
+// rows directly on the port registers (2 driver calls per column instead of
+// 6 pin accesses). All rows and all columns must be on one port each.
+static void scan_raw_matrix(matrix_row_t raw_rows[MATRIX_ROWS]) {
+  const struct device *col_port = gpio_cols[0].port;
+  const struct device *row_port = gpio_rows[0].port;
+  gpio_port_value_t rows;
+
+  for (uint8_t col = 0; col < MATRIX_COLS; col++) {
+    gpio_port_set_bits_raw(col_port, BIT(gpio_cols[col].pin));
+    if (SCAN_SETTLE_US > 0) {
+      k_busy_wait(SCAN_SETTLE_US);
+    }
+    gpio_port_get_raw(row_port, &rows);
+    gpio_port_clear_bits_raw(col_port, BIT(gpio_cols[col].pin));
+
+    for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+      raw_rows[row] |= ((rows >> gpio_rows[row].pin) & 1) << col;
+    }
+  }
 }
 
-void read_key_matrix(void) {
-  struct pressed_keys res = {0};
+enum matrix_state read_key_matrix(void) {
+  // debounce works in place on the previous state
+  struct pressed_keys res = current_pressed_keys;
   res.wake_pressed = wake_pressed();
-  uint8_t row, col;
+  matrix_row_t raw_rows[MATRIX_ROWS] = {0};
+
+  uint32_t start_cyc = k_cycle_get_32();
+  scan_raw_matrix(raw_rows);
+  scan_stats.scan_us = k_cyc_to_us_floor32(k_cycle_get_32() - start_cyc);
+
+  bool raw_pressed = false;
+  for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+    raw_pressed |= raw_rows[row] != 0;
+  }
+
+  bool debouncing = debounce(raw_rows, res.rows, k_uptime_get_32());
 
-  for (col = 0; col < ARRAY_SIZE(gpio_cols); col++) {
+  last_pressed_keys = current_pressed_keys;
+  current_pressed_keys = res;
+  if (debouncing) {
+    return MATRIX_BOUNCING;
+  } else if (raw_pressed || res.wake_pressed) {
+    return MATRIX_HELD;
+  }
+  return MATRIX_IDLE;
+}
+
+#ifdef CONFIG_TIMING_FUNCTIONS
+// reference implementation using the per pin API, only for the benchmark
+static void scan_raw_matrix_pins(matrix_row_t raw_rows[MATRIX_ROWS]) {
+  for (uint8_t col = 0; col < MATRIX_COLS; col++) {
     gpio_pin_set_dt(&gpio_cols[col], 1);
-    for (row = 0; row < ARRAY_SIZE(gpio_rows); row++) {
+    for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
       if (gpio_pin_get_dt(&gpio_rows[row]) == 1) {
-        res.keys[res.n_pressed].row = row;
-        res.keys[res.n_pressed].col = col;
-        res.n_pressed++;
-        if (res.n_pressed >= MAX_N_PRESSED_KEYS) {
-          break;
-        }
+        raw_rows[row] |= BIT(col);
       }
     }
     gpio_pin_set_dt(&gpio_cols[col], 0);
   }
+}
+
+#define SCAN_BENCHMARK_ITERATIONS 1000
+
+void benchmark_key_matrix(void) {
+  matrix_row_t raw_rows[MATRIX_ROWS];
+  timing_t start, end;
+
+  timing_start();
+  start = timing_counter_get();
+  for (int i = 0; i < SCAN_BENCHMARK_ITERATIONS; i++) {
+    scan_raw_matrix_pins(raw_rows);
+  }
+  end = timing_counter_get();
+  uint64_t pin_cycles = timing_cycles_get(&start, &end);
 
-  last_pressed_keys = current_pressed_keys;
-  current_pressed_keys = res;
+  start = timing_counter_get();
+  for (int i = 0; i < SCAN_BENCHMARK_ITERATIONS; i++) {
+    scan_raw_matrix(raw_rows);
+  }
+  end = timing_counter_get();
+  uint64_t port_cycles = timing_cycles_get(&start, &end);
+  timing_stop();
+
+  printk("matrix scan: per pin %llu cycles, port %llu cycles (settle %dus)\n",
+         pin_cycles / SCAN_BENCHMARK_ITERATIONS,
+         port_cycles / SCAN_BENCHMARK_ITERATIONS, SCAN_SETTLE_US);
 }
+#endif
 
 bool wake_pressed(void) { return gpio_pin_get_dt(&wake_btn); }
 
-int wait_for_key(int timeout_ms) {
+static int wait_for_key(k_timeout_t timeout) {
   enable_row_interrupts();
   k_sem_take(&wake_sem, K_NO_WAIT);
   gpio_port_set_bits(gpio_cols[0].port, drive_pins);
-  int ret = k_sem_take(&wake_sem, K_MSEC(timeout_ms));
+  int ret = k_sem_take(&wake_sem, timeout);
   gpio_port_clear_bits(gpio_cols[0].port, drive_pins);
   return ret;
 }
 
-bool eq_pressed_keys(struct pressed_keys a, struct pressed_keys b) {
-  if (a.n_pressed != b.n_pressed || a.wake_pressed != b.wake_pressed) {
-    return false;
+// Wait for a key press in a column without held keys (or a wake button
+// change). Presses in the same column as a held key and releases are only
+// seen when the timeout expires and the matrix is scanned again, so the
+// timeout is kept short.
+static int wait_for_new_key(const struct pressed_keys *held,
+                            k_timeout_t timeout) {
+  matrix_row_t held_cols = 0;
+  for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+    held_cols |= held->rows[row];
+  }
+  gpio_port_pins_t idle_col_pins = 0;
+  for (uint8_t col = 0; col < MATRIX_COLS; col++) {
+    if (!(held_cols & BIT(col))) {
+      idle_col_pins |= BIT(gpio_cols[col].pin);
+    }
+  }
+
+  k_sem_take(&wake_sem, K_NO_WAIT);
+  gpio_port_set_bits_raw(gpio_cols[0].port, idle_col_pins);
+  enable_held_interrupts();
+  int ret = k_sem_take(&wake_sem, timeout);
+  disable_row_interrupts();
+  gpio_port_clear_bits_raw(gpio_cols[0].port, idle_col_pins);
+  return ret;
+}
+
+uint8_t count_pressed_keys(const struct pressed_keys *keys) {
+  uint8_t n = 0;
+  for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+    n += __builtin_popcount(keys->rows[row]);
   }
+  return n;
+}
+
+bool any_key_pressed(const struct pressed_keys *keys) {
+  matrix_row_t any = 0;
+  for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+    any |= keys->rows[row];
+  }
+  return any != 0;
+}
 
-  for (int i = 0; i < a.n_pressed; i++) {
-    if (!keq(a.keys[i], b.keys[i])) {
-      return false;
+bool first_pressed_key(const struct pressed_keys *keys, struct key_coord *key) {
+  bool found = false;
+  for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+    if (keys->rows[row] == 0) {
+      continue;
+    }
+    uint8_t col = __builtin_ctz(keys->rows[row]);
+    // only a lower column wins, on ties the lower row (found first) is kept
+    if (!found || col < key->col) {
+      *key = (struct key_coord){row, col};
+      found = true;
     }
   }
+  return found;
+}
+
+bool eq_pressed_keys(const struct pressed_keys *a,
+                     const struct pressed_keys *b) {
+  if (a->wake_pressed != b->wake_pressed) {
+    return false;
+  }
+  matrix_row_t diff = 0;
+  for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+    diff |= a->rows[row] ^ b->rows[row];
+  }
+  return diff == 0;
+}
+
+static void push_row_changes(uint8_t row, matrix_row_t changed, bool pressed,
+                             uint32_t time_ms) {
+  while (changed) {
+    uint8_t col = __builtin_ctz(changed);
+    changed &= changed - 1;
+    key_event_push((struct key_event){{row, col}, pressed, time_ms});
+  }
+}
+
+// Push one event per key that differs between old and new (XOR of the row
+// bitmaps). Releases go first: with slow polling a modifier release and the
+// next key press can show up in the same scan, and the host must not see
+// them overlap.
+static void push_key_changes(const struct pressed_keys *old,
+                             const struct pressed_keys *new, uint32_t time_ms) {
+  if (old->wake_pressed && !new->wake_pressed) {
+    key_event_push((struct key_event){WAKE_KEY, false, time_ms});
+  }
+  for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+    push_row_changes(row, old->rows[row] & ~new->rows[row], false, time_ms);
+  }
+  if (!old->wake_pressed && new->wake_pressed) {
+    key_event_push((struct key_event){WAKE_KEY, true, time_ms});
+  }
+  for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+    push_row_changes(row, ~old->rows[row] & new->rows[row], true, time_ms);
+  }
+}
+
+// time of the last published change, to detect long holds
+static uint32_t last_change_ms;
+
+static void publish_key_change(void) {
+  if (eq_pressed_keys(&last_pressed_keys, &current_pressed_keys)) {
+    return;
+  }
+  last_change_ms = k_uptime_get_32();
+  push_key_changes(&last_pressed_keys, &current_pressed_keys, last_change_ms);
+}
+
+// accumulates the periodic scans and publishes rate & jitter to scan_stats
+// once SCAN_STATS_WINDOW_MS of (possibly interrupted) scanning is collected
+struct scan_window {
+  uint32_t last_scan_cyc;
+  uint32_t active_us;
+  uint32_t n_intervals;
+  uint32_t max_jitter_us;
+};
+
+static void scan_window_add(struct scan_window *w, uint32_t now_cyc,
+                            uint16_t period_ms) {
+  uint32_t interval_us = k_cyc_to_us_floor32(now_cyc - w->last_scan_cyc);
+  uint32_t jitter_us = abs((int32_t)interval_us - period_ms * 1000);
+  w->last_scan_cyc = now_cyc;
+  w->active_us += interval_us;
+  w->n_intervals++;
+  w->max_jitter_us = MAX(w->max_jitter_us, jitter_us);
+
+  if (w->active_us >= SCAN_STATS_WINDOW_MS * 1000) {
+    scan_stats.rate_hz = (uint64_t)w->n_intervals * 1000000 / w->active_us;
+    scan_stats.jitter_us = w->max_jitter_us;
+    *w = (struct scan_window){.last_scan_cyc = now_cyc};
+  }
+}
+
+struct scan_tier_cfg {
+  const char *name;
+  uint32_t after_ms;   // time since the last key change to enter the tier
+  uint16_t period_ms;  // scan period, or poll period for sleeping tiers
+  bool sleep;          // sleep on row interrupts between polls
+};
+
+static const struct scan_tier_cfg scan_tiers[__SCAN_N_TIERS] = {
+    [SCAN_TIER_IDLE] = {"idle", 0, 0, true},
+    [SCAN_TIER_BURST] = {"burst", 0, SCAN_BURST_PERIOD_MS, false},
+    [SCAN_TIER_SLOW] = {"slow", SCAN_SLOW_AFTER_MS, SCAN_SLOW_PERIOD_MS,
+                        false},
+    [SCAN_TIER_HOLD] = {"hold", SCAN_HOLD_AFTER_MS, SCAN_BURST_PERIOD_MS, true},
+};
+
+const char *scan_tier_name(enum scan_tier tier) {
+  return scan_tiers[tier].name;
+}
+
+static enum scan_tier select_scan_tier(enum matrix_state state) {
+  if (state == MATRIX_BOUNCING) {
+    return SCAN_TIER_BURST;
+  }
+  uint32_t since_change_ms = k_uptime_get_32() - last_change_ms;
+  enum scan_tier tier = SCAN_TIER_BURST;
+  while (tier + 1 < __SCAN_N_TIERS &&
+         since_change_ms >= scan_tiers[tier + 1].after_ms) {
+    tier++;
+  }
+  return tier;
+}
+
+static void scan_thread(void *p1, void *p2, void *p3) {
+  struct scan_window window = {0};
+  while (1) {
+    // nothing held, no need to scan until a row interrupt fires
+    scan_stats.tier = SCAN_TIER_IDLE;
+    wait_for_key(K_FOREVER);
+    last_change_ms = k_uptime_get_32();
+
+    enum matrix_state state = read_key_matrix();
+    publish_key_change();
+    uint16_t timer_period_ms = 0;  // 0: timer not running
 
-  return true;
+    while (state != MATRIX_IDLE) {
+      enum scan_tier tier = select_scan_tier(state);
+      const struct scan_tier_cfg *cfg = &scan_tiers[tier];
+      scan_stats.tier = tier;
+
+      if (cfg->sleep) {
+        // e.g. a held modifier, sleep until a new key is pressed
+        k_timer_stop(&scan_timer);
+        timer_period_ms = 0;
+        wait_for_new_key(&current_pressed_keys, K_MSEC(cfg->period_ms));
+        state = read_key_matrix();
+        publish_key_change();
+        continue;
+      }
+
+      if (timer_period_ms != cfg->period_ms) {
+        timer_period_ms = cfg->period_ms;
+        k_timer_start(&scan_timer, K_MSEC(timer_period_ms),
+                      K_MSEC(timer_period_ms));
+        window.last_scan_cyc = k_cycle_get_32();
+      }
+      k_timer_status_sync(&scan_timer);
+      state = read_key_matrix();
+      publish_key_change();
+      scan_window_add(&window, k_cycle_get_32(), timer_period_ms);
+    }
+    k_timer_stop(&scan_timer);
+  }
 }
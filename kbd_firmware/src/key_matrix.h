@@ -6,15 +6,56 @@
 
 #include "config.h"
 
-void read_key_matrix(void);
+// scan tiers, see config.h
+enum scan_tier {
+  SCAN_TIER_IDLE,  // nothing held, row interrupts only
+  SCAN_TIER_BURST,
+  SCAN_TIER_SLOW,
+  SCAN_TIER_HOLD,
+  __SCAN_N_TIERS,
+};
+
+const char *scan_tier_name(enum scan_tier tier);
+
+// statistics of the periodic (keys held) scan
+struct scan_stats {
+  enum scan_tier tier;
+  uint32_t rate_hz;    // achieved scans per second in the periodic tiers
+  uint32_t jitter_us;  // max deviation from the tier period in the last window
+  uint32_t scan_us;    // duration of the last raw scan
+};
+
+extern struct scan_stats scan_stats;
+
+enum matrix_state {
+  MATRIX_IDLE,      // nothing pressed, row interrupts can take over
+  MATRIX_HELD,      // keys (or wake) held, debounced state is stable
+  MATRIX_BOUNCING,  // debounce still pending, keep scanning
+};
+
+// scan & debounce the matrix into current_pressed_keys
+enum matrix_state read_key_matrix(void);
 
 void init_key_matrix(void);
 
 bool wake_pressed(void);
 
-int wait_for_key(int timeout_ms);
+uint8_t count_pressed_keys(const struct pressed_keys *keys);
 
+bool any_key_pressed(const struct pressed_keys *keys);
+
+// first pressed key in column-major order, returns false if none is pressed
+bool first_pressed_key(const struct pressed_keys *keys, struct key_coord *key);
+
+bool eq_pressed_keys(const struct pressed_keys *a,
+                     const struct pressed_keys *b);
+
+// print cycles per full scan for the port and per pin scan paths
+// (needs CONFIG_TIMING_FUNCTIONS)
+void benchmark_key_matrix(void);
+
+// state of the last scan, owned by the scan thread. Consumers that need
+// every press/release should read the key event ring (key_events.h).
 extern struct pressed_keys current_pressed_keys;
-extern struct pressed_keys last_pressed_keys;
 
 #endif  // KEY_MATRIX_H
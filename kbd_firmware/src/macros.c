@@ -0,0 +1,188 @@
+#include "macros.h"
+
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/printk.h>
+
+#include "bluetooth.h"
+#include "config.h"
+#include "key_events.h"
+
+// macros and plain reports, in the order they were sent
+struct macro_item {
+  const struct macro *macro;  // NULL for a plain report
+  struct encoded_keys report;
+};
+
+K_MSGQ_DEFINE(macro_msgq, sizeof(struct macro_item), MACRO_QUEUE_SIZE, 4);
+
+// items in macro_msgq plus the one the player is on. Reports only go straight
+// to the HID queue while it is 0, so nothing overtakes a macro. Only
+// increased by the main thread, which sends all reports.
+static atomic_t n_pending = ATOMIC_INIT(0);
+
+static void macro_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(macro_work, macro_work_handler);
+
+// only touched by macro_work_handler, except for in_flight
+static struct {
+  const struct macro *macro;  // NULL if no macro is playing
+  uint16_t step;              // next step to press
+  bool pressed;               // the last report pressed steps[step - 1]
+  int64_t last_sent_ticks;
+  int64_t start_ticks;
+  // a plain or macro report the HID queue had no room for yet
+  struct encoded_keys report;
+  bool has_report;
+} player = {0};
+
+// a macro report is waiting for its completion
+static atomic_t in_flight = ATOMIC_INIT(0);
+
+struct macro_stats macro_stats = {0};
+
+static void macro_report_sent(struct bt_conn *conn, void *user_data) {
+  atomic_clear(&in_flight);
+  k_work_reschedule(&macro_work, K_NO_WAIT);
+}
+
+// Next report of the playing macro, false once it is finished. A key is only
+// released before the next step if the host couldn't tell them apart
+// otherwise: same key again or different modifiers.
+static bool next_macro_report(struct encoded_keys *report) {
+  *report = (struct encoded_keys){0};
+  if (player.step == player.macro->n_steps) {
+    bool release = player.pressed;
+    player.pressed = false;
+    return release;
+  }
+  const struct macro_step *step = &player.macro->steps[player.step];
+  if (player.pressed) {
+    const struct macro_step *last = &player.macro->steps[player.step - 1];
+    if (step->key == last->key || step->mod != last->mod) {
+      player.pressed = false;
+      return true;
+    }
+  }
+  report->modifier_mask = step->mod;
+  encoded_keys_set(report, step->key, true);
+  player.pressed = true;
+  player.step++;
+  return true;
+}
+
+static void finish_macro() {
+  uint32_t duration_ms =
+      k_ticks_to_ms_floor64(k_uptime_ticks() - player.start_ticks);
+  macro_stats.n_played++;
+  macro_stats.cps = player.macro->n_steps * 1000 / MAX(duration_ms, 1);
+  printk("Macro done, %d keys in %dms\n", player.macro->n_steps, duration_ms);
+  player.macro = NULL;
+}
+
+// the HID queue is full, try again after the next connection event
+static void retry_later() {
+  k_work_reschedule(&macro_work, K_USEC(MAX(ble_conn_interval_us(), 1000)));
+}
+
+static void macro_work_handler(struct k_work *work) {
+  while (1) {
+    if (player.macro == NULL && !player.has_report) {
+      struct macro_item item;
+      if (k_msgq_get(&macro_msgq, &item, K_NO_WAIT) != 0) {
+        // reports go straight to the HID queue again, wake the main loop
+        // waiting for room
+        key_event_wake();
+        return;
+      }
+      if (item.macro == NULL) {
+        player.report = item.report;
+        player.has_report = true;
+      } else {
+        player.macro = item.macro;
+        player.step = 0;
+        player.pressed = false;
+        player.start_ticks = k_uptime_ticks();
+        // the first report can be sent right away
+        player.last_sent_ticks =
+            player.start_ticks - k_us_to_ticks_ceil64(ble_conn_interval_us());
+      }
+    }
+
+    if (player.macro == NULL) {
+      // a plain report queued behind a macro
+      if (queue_encoded_keys(player.report, NULL) == -ENOMEM) {
+        retry_later();
+        return;
+      }
+      player.has_report = false;
+      atomic_dec(&n_pending);
+      continue;
+    }
+
+    if (atomic_get(&in_flight)) {
+      return;  // macro_report_sent() continues
+    }
+    int64_t next_ticks =
+        player.last_sent_ticks + k_us_to_ticks_ceil64(ble_conn_interval_us());
+    int64_t now_ticks = k_uptime_ticks();
+    if (now_ticks < next_ticks) {
+      k_work_reschedule(&macro_work, K_TICKS(next_ticks - now_ticks));
+      return;
+    }
+
+    if (!player.has_report) {
+      if (!next_macro_report(&player.report)) {
+        finish_macro();
+        atomic_dec(&n_pending);
+        continue;
+      }
+      player.has_report = true;
+    }
+    atomic_set(&in_flight, 1);
+    int err = queue_encoded_keys(player.report, macro_report_sent);
+    if (err == -ENOMEM) {
+      atomic_clear(&in_flight);
+      retry_later();
+      return;
+    }
+    player.has_report = false;
+    if (err == 0) {
+      player.last_sent_ticks = now_ticks;
+      return;
+    }
+    atomic_clear(&in_flight);
+    printk("Macro aborted, err %d\n", err);
+    player.macro = NULL;
+    atomic_dec(&n_pending);
+  }
+}
+
+uint8_t macro_queue_depth() { return atomic_get(&n_pending); }
+
+void play_macro(const struct macro *macro) {
+  struct macro_item item = {.macro = macro};
+  // counted first, the work may finish it right away
+  atomic_inc(&n_pending);
+  if (k_msgq_put(&macro_msgq, &item, K_NO_WAIT) != 0) {
+    atomic_dec(&n_pending);
+    printk("Macro queue full, dropping macro\n");
+    return;
+  }
+  k_work_reschedule(&macro_work, K_NO_WAIT);
+}
+
+int send_report(struct encoded_keys keys) {
+  if (atomic_get(&n_pending) == 0) {
+    return queue_encoded_keys(keys, NULL);
+  }
+  struct macro_item item = {.report = keys};
+  atomic_inc(&n_pending);
+  if (k_msgq_put(&macro_msgq, &item, K_NO_WAIT) != 0) {
+    atomic_dec(&n_pending);
+    return -ENOMEM;
+  }
+  k_work_reschedule(&macro_work, K_NO_WAIT);
+  return 0;
+}
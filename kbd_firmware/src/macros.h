@@ -0,0 +1,44 @@
+#ifndef MACROS_H
+#define MACROS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+// Macros tap a sequence of keys. Their reports are paced to the BLE link:
+// the next report is only sent once the previous one is acknowledged and at
+// least one connection interval later, so every report gets its own
+// connection event and the host never merges or drops keystrokes.
+// While a macro plays, held keys are released on the host and other reports
+// are sent after it.
+
+// one tapped key, with its modifiers
+struct macro_step {
+  uint8_t key;  // HID key code
+  uint8_t mod;  // Modifier key mask (e.g., KEY_MOD_LCTRL)
+};
+
+struct macro {
+  const struct macro_step *steps;
+  uint16_t n_steps;
+};
+
+struct macro_stats {
+  uint32_t n_played;
+  uint32_t cps;  // keys per second of the last macro
+};
+
+extern struct macro_stats macro_stats;
+
+void play_macro(const struct macro *macro);
+
+// macros and reports not yet handed to the HID queue
+uint8_t macro_queue_depth();
+
+// Sends a report to the host, straight to the HID queue unless it has to wait
+// for a macro. Returns -ENOMEM if there is no room, the caller keeps the
+// report and tries again once the queues drained (see key_event_wake()).
+int send_report(struct encoded_keys keys);
+
+#endif  // MACROS_H
@@ -16,14 +16,18 @@
 #include <zephyr/settings/settings.h>
 #include <zephyr/sys/byteorder.h>
 #include <zephyr/sys/printk.h>
+#include <zephyr/timing/timing.h>
 #include <zephyr/types.h>
 
 #include "bluetooth.h"
 #include "config.h"
 #include "fuel_gauge/fuel_gauge.h"
+#include "key_buffer.h"
+#include "key_events.h"
 #include "key_layout.h"
 #include "key_matrix.h"
 #include "leds.h"
+#include "macros.h"
 #include "nvs.h"
 #include "pmic.h"
 #include "ui.h"
@@ -68,8 +72,88 @@ void i2c_scanner(const struct device *bus) {
       "https://i2cdevices.org/addresses\n\n");
 }
 
+// Recorded while the host can't receive the reports or the report queues
+// couldn't take all reports of the last event yet, see key_buffer.h
+static bool buffering_keys() {
+  struct encoded_keys report;
+  return !ble_is_ready() || !key_buffer_empty() || next_key_report(&report);
+}
+
+static void layout_key_event(struct key_event event) {
+  if (buffering_keys()) {
+    key_buffer_push(event);
+  } else {
+    process_key_event(event);
+  }
+}
+
+// keys is the state after the event
+static void handle_key_event(struct key_event event,
+                             const struct pressed_keys *keys) {
+  if (is_wake_key(event.coord)) {
+    if (event.pressed && !any_key_pressed(keys)) {
+      ui_send_wake();
+    } else if (!event.pressed && !application_running) {
+      // the reports were held back while wake was pressed, send the state
+      // so no key released meanwhile stays pressed on the host
+      report_current_keys();
+    }
+  } else if (!event.pressed) {
+    // always process releases so no key stays active
+    layout_key_event(event);
+  } else {
+    if (keys->wake_pressed) {
+      ui_send_wake_and_key(event.coord);
+    } else if (!application_running) {
+      layout_key_event(event);
+    }
+    if (ui_active()) {
+      // TODO: doesn't really make sense, maybe just get rid of the key
+      // message?
+      ui_send_key(event.coord);
+    }
+  }
+
+  if (!keys->wake_pressed && application_running) {
+    // applications take exclusive control of the keys, send empty to clear
+    // any previous keys
+    send_report((struct encoded_keys){0});
+  }
+}
+
+// Sends the reports of the processed events, one per event so a press and
+// release are never merged. Reports the queues have no room for stay in the
+// layout until they drained, returns false if any are left.
+static bool send_key_reports(const struct pressed_keys *keys) {
+  struct encoded_keys report;
+  while (next_key_report(&report)) {
+    if (!keys->wake_pressed && !application_running &&
+        send_report(report) == -ENOMEM) {
+      return false;
+    }
+    pop_key_report();
+  }
+  return true;
+}
+
+// Replays the recorded events once the host is ready. The next event waits
+// until the reports of the previous one were sent, so they are paced by the
+// link and the report queues never fill up. Sent reports wake the main loop.
+static void replay_key_buffer(const struct pressed_keys *keys) {
+  if (!ble_is_ready()) {
+    return;
+  }
+  struct key_event event;
+  // reports move from the macro queue to the HID queue, check it first
+  while (send_key_reports(keys) && macro_queue_depth() == 0 &&
+         hid_queue_depth() == 0 && key_buffer_pop(&event)) {
+    // tap-hold & combo timeouts as they would have happened
+    process_key_timeout(event.time_ms);
+    process_key_event(event);
+  }
+}
+
 int main(void) {
-  int ret;
   printk("Starting wrls atreus\n");
   k_msleep(50);
   init_leds();
@@ -91,12 +175,24 @@ int main(void) {
 
   printk("Init key matrix\n");
   init_key_matrix();
+#ifdef CONFIG_TIMING_FUNCTIONS
+  timing_init();
+  benchmark_key_matrix();
+  suspend_ui();
+  benchmark_display();
+  benchmark_drawing();
+  resume_ui();
+#endif
   uint32_t last_active_time = k_uptime_seconds();
   uint32_t last_no_pressed_time = last_active_time;
 
   uint32_t last_bas_sent = k_uptime_seconds();
   send_bas_soc(battery_state.soc);
 
+  struct key_event_reader key_reader;
+  struct pressed_keys keys;
+  key_event_reader_init(&key_reader, &keys);
+
   while (1) {
     uint32_t seconds_since_active = k_uptime_seconds() - last_active_time;
     uint32_t seconds_since_no_pressed =
@@ -110,37 +206,29 @@ int main(void) {
       ui_send_wake_and_key((struct key_coord){1, 6});  // S
     }
 
-    read_key_matrix();
-
-    if (!eq_pressed_keys(last_pressed_keys, current_pressed_keys)) {
+    // scanning happens in the key matrix thread, we only handle its events
+    // wake up in time to decide pending tap-hold keys, while recording the
+    // layout doesn't see the events yet
+    bool buffering = buffering_keys();
+    int32_t timeout_ms =
+        buffering ? -1 : key_layout_timeout_ms(k_uptime_get_32());
+    if (timeout_ms < 0 || timeout_ms > MAIN_LOOP_TIMEOUT_MS) {
+      timeout_ms = MAIN_LOOP_TIMEOUT_MS;
+    }
+    struct key_event event;
+    if (key_event_wait(&key_reader, &event, timeout_ms) == 0) {
       last_active_time = k_uptime_seconds();
-
-      if (current_pressed_keys.wake_pressed) {
-        if (current_pressed_keys.n_pressed > 0) {
-          ui_send_wake_and_key(current_pressed_keys.keys[0]);
-        } else if (!last_pressed_keys.wake_pressed) {
-          ui_send_wake();
-        }
-      } else {
-        // applications take exclusive control of the keys
-        // so only send them to the host if they are not running
-        if (application_running) {
-          // send empty to clear any previous keys
-          send_encoded_keys((struct encoded_keys){0});  // send empty keys
-        } else {
-          struct encoded_keys encoded_keys = get_encoded_keys();
-          send_encoded_keys(encoded_keys);
-        }
-      }
-      if (ui_active() && current_pressed_keys.n_pressed > 0) {
-        // TODO: doesn't really make sense, maybe just get rid of the key
-        // message?
-        ui_send_key(current_pressed_keys.keys[0]);
-      }
+      apply_key_event(&keys, event);
+      handle_key_event(event, &keys);
+    } else if (!buffering) {
+      process_key_timeout(k_uptime_get_32());
     }
+    update_key_layout();
+    key_buffer_expire(k_uptime_get_32());
+    replay_key_buffer(&keys);
+    send_key_reports(&keys);
 
-    if (current_pressed_keys.n_pressed == 0 &&
-        !current_pressed_keys.wake_pressed) {
+    if (!any_key_pressed(&keys) && !keys.wake_pressed) {
       last_no_pressed_time = k_uptime_seconds();
     }
 
@@ -149,16 +237,6 @@ int main(void) {
       send_bas_soc(battery_state.soc);
       printk("Sent battery SOC %d", (uint8_t)battery_state.soc);
     }
-
-    if (current_pressed_keys.n_pressed > 0 ||
-        current_pressed_keys.wake_pressed) {
-      // if keys are pressed always sleep for 50ms
-      // (we can't use the level interrupt here)
-      // TODO: could switch to edge interrupt in this case??
-      k_msleep(50);
-    } else {
-      ret = wait_for_key(2000);
-    }
   }
 
   return 0;
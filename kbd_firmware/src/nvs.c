@@ -8,7 +8,6 @@
 #include <zephyr/storage/flash_map.h>
 #include <zephyr/sys/printk.h>
 
-#include "bluetooth.h"
 #include "config.h"
 
 #define NVS_PARTITION custom_nvs_storage
@@ -18,16 +17,19 @@
 static struct nvs_fs fs;
 
 #define N_BOOT 1
-#define CTRL_CMD 2
+#define CTRL_CMD 2  // no longer written, was keyed by host address
+#define HOST_SLOTS 4
 
-struct ctrl_cmd_config {
+// per host settings
+struct host_slot {
+  bt_addr_le_t peer;  // the host that connected last
+  bool has_peer;
   bool swap_ctrl_cmd;
-  char addr[BT_ADDR_LE_STR_LEN];
 };
 
-struct ctrl_cmd_configs {
-  struct ctrl_cmd_config configs[CONFIG_BT_MAX_PAIRED];
-  uint8_t n_configs;
+struct host_slots {
+  struct host_slot slots[N_HOST_SLOTS];
+  uint8_t current;
 };
 
 int nvs_init() {
@@ -47,49 +49,54 @@ int nvs_init() {
   return 0;
 }
 
-struct ctrl_cmd_configs nvs_read_ctrl_cmd_configs() {
-  struct ctrl_cmd_configs cfgs = {0};
-  int ret = nvs_read(&fs, CTRL_CMD, &cfgs, sizeof(cfgs));
+static struct host_slots nvs_read_host_slots() {
+  struct host_slots slots = {0};
+  int ret = nvs_read(&fs, HOST_SLOTS, &slots, sizeof(slots));
+  if (ret != sizeof(slots) || slots.current >= N_HOST_SLOTS) {
+    return (struct host_slots){0};
+  }
+  return slots;
+}
 
-  return (ret < 0) ? (struct ctrl_cmd_configs){0} : cfgs;
+static void nvs_write_host_slots(const struct host_slots *slots) {
+  nvs_write(&fs, HOST_SLOTS, slots, sizeof(*slots));
 }
 
-void nvs_store_ctrl_cmd(bool swap_ctrl_cmd) {
-  struct addr addr = get_current_addr();
-  struct ctrl_cmd_configs cfgs = nvs_read_ctrl_cmd_configs();
-  bool found = false;
-  for (int i = 0; i < cfgs.n_configs; i++) {
-    if (strcmp(cfgs.configs[i].addr, addr.addr) == 0) {
-      found = true;
-      cfgs.configs[i].swap_ctrl_cmd = swap_ctrl_cmd;
-    }
+uint8_t nvs_get_host_slot() { return nvs_read_host_slots().current; }
+
+void nvs_store_host_slot(uint8_t slot) {
+  struct host_slots slots = nvs_read_host_slots();
+  if (slots.current != slot) {
+    slots.current = slot;
+    nvs_write_host_slots(&slots);
   }
-  if (!found) {
-    struct ctrl_cmd_config new_config = {
-        .swap_ctrl_cmd = swap_ctrl_cmd,
-    };
-    strcpy(new_config.addr, addr.addr);
-    if (cfgs.n_configs >= CONFIG_BT_MAX_PAIRED) {
-      // storage full, get rid of oldest config
-      for (int i = 0; i < CONFIG_BT_MAX_PAIRED - 1; i++) {
-        cfgs.configs[i] = cfgs.configs[i + 1];
-      }
-      cfgs.n_configs--;
-    }
-    cfgs.configs[cfgs.n_configs] = new_config;
-    cfgs.n_configs++;
+}
+
+bool nvs_get_slot_peer(uint8_t slot, bt_addr_le_t *peer) {
+  struct host_slots slots = nvs_read_host_slots();
+  *peer = slots.slots[slot].peer;
+  return slots.slots[slot].has_peer;
+}
+
+void nvs_store_slot_peer(uint8_t slot, const bt_addr_le_t *peer) {
+  struct host_slots slots = nvs_read_host_slots();
+  struct host_slot *s = &slots.slots[slot];
+  if (s->has_peer && bt_addr_le_eq(&s->peer, peer)) {
+    return;
   }
+  // a new host doesn't inherit the settings of the last one
+  *s = (struct host_slot){.has_peer = true};
+  bt_addr_le_copy(&s->peer, peer);
+  nvs_write_host_slots(&slots);
+}
 
-  nvs_write(&fs, CTRL_CMD, &cfgs, sizeof(cfgs));
+void nvs_store_ctrl_cmd(bool swap_ctrl_cmd) {
+  struct host_slots slots = nvs_read_host_slots();
+  slots.slots[slots.current].swap_ctrl_cmd = swap_ctrl_cmd;
+  nvs_write_host_slots(&slots);
 }
 
 bool nvs_get_ctrl_cmd_config() {
-  struct ctrl_cmd_configs cfgs = nvs_read_ctrl_cmd_configs();
-  struct addr addr = get_current_addr();
-  for (int i = 0; i < cfgs.n_configs; i++) {
-    if (strcmp(cfgs.configs[i].addr, addr.addr) == 0) {
-      return cfgs.configs[i].swap_ctrl_cmd;
-    }
-  }
-  return false;
+  struct host_slots slots = nvs_read_host_slots();
+  return slots.slots[slots.current].swap_ctrl_cmd;
 }
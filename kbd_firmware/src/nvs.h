@@ -2,10 +2,19 @@
 #define NVS_H
 #include <stdbool.h>
 #include <stdint.h>
+#include <zephyr/bluetooth/bluetooth.h>
 
 int nvs_init();
 
+// Settings of the current host slot, see N_HOST_SLOTS. The slot is also the
+// Bluetooth identity its host is bonded with.
 bool nvs_get_ctrl_cmd_config();
 void nvs_store_ctrl_cmd(bool swap_ctrl_cmd);
 
+uint8_t nvs_get_host_slot();
+void nvs_store_host_slot(uint8_t slot);
+// the host that connected to a slot last, for directed advertising
+bool nvs_get_slot_peer(uint8_t slot, bt_addr_le_t *peer);
+void nvs_store_slot_peer(uint8_t slot, const bt_addr_le_t *peer);
+
 #endif  // NVS_H
@@ -26,12 +26,17 @@
 #include "applications/mines.h"
 #include "applications/snake.h"
 #include "applications/tetris.h"
+#include "applications/utils.h"
 #include "bluetooth.h"
 #include "config.h"
+#include "conn_params.h"
 #include "display.h"
 #include "fuel_gauge/fuel_gauge.h"
+#include "key_buffer.h"
+#include "key_events.h"
 #include "key_layout.h"
 #include "key_matrix.h"
+#include "macros.h"
 #include "nvs.h"
 #include "pmic.h"
 
@@ -135,7 +140,12 @@ enum ui_page {
   UI_PAGE_HELP = 7,
   UI_PAGE_APPS = 8,
   UI_PAGE_IDLE = 9,
-  __UI_N_PAGES = 10,
+  UI_PAGE_PAIR = 10,
+  UI_PAGE_HOST_1 = 11,  // one page per host slot
+  UI_PAGE_HOST_2 = 12,
+  UI_PAGE_HOST_3 = 13,
+  UI_PAGE_HOST_4 = 14,
+  __UI_N_PAGES = 15,
 };
 struct anim_state {
   uint32_t frame_idx;
@@ -165,6 +175,7 @@ bool show_animation(struct anim_state *state, struct animation *anim,
     state->frame_idx = anim->init_idx;
   }
   memcpy(displayBuffer, anim->frames[state->frame_idx], sizeof(displayBuffer));
+  lcd_mark_dirty(0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT / 8);
   if (show_soc) {
     char soc_str[6];
     sprintf(soc_str, "%.0f%%", (double)battery_state.soc);
@@ -194,20 +205,71 @@ bool show_animation(struct anim_state *state, struct animation *anim,
 // page implementations
 // TODO: move to separate files
 
+#define N_DEBUG_PAGES 4
+
 void show_debug_page(struct ui_message msg, struct ui_state *state) {
+  // any key switches to the next page
+  if (msg.type == UI_MESSAGE_TYPE_KEY_PRESSED) {
+    state->page_state.idx = (state->page_state.idx + 1) % N_DEBUG_PAGES;
+  }
   int64_t uptime = k_uptime_get();
-  char str[120];
-  sprintf(
-      str,
-      "usb %d s %d e %d \n %1.0fmA %1.3fV conn: %d\nuptime: %4lldm "
-      "%2llds\nks: %d wake: %d\nswap: %d\nsoc: %.2f%%\ntte: %.1fh ttf: %.0fm",
-      pmic_state.vbus_present, pmic_state.charger_status,
-      pmic_state.charger_error, (double)pmic_state.battery_current * 1000,
-      (double)pmic_state.battery_voltage, ble_is_connected(), uptime / 60000,
-      uptime % 60000 / 1000, current_pressed_keys.n_pressed,
-      current_pressed_keys.wake_pressed, ctrl_cmd_swapped,
-      (double)battery_state.soc, (double)(battery_state.tte_s / 60.f / 60.f),
-      (double)(battery_state.ttf_s / 60.f));
+  char str[256];
+  switch (state->page_state.idx) {
+    case 0:
+      sprintf(str,
+              "usb %d s %d e %d \n %1.0fmA %1.3fV conn: %d\nuptime: %4lldm "
+              "%2llds\nks: %d wake: %d\nswap: %d\nsoc: %.2f%%\ntte: %.1fh "
+              "ttf: %.0fm",
+              pmic_state.vbus_present, pmic_state.charger_status,
+              pmic_state.charger_error,
+              (double)pmic_state.battery_current * 1000,
+              (double)pmic_state.battery_voltage, ble_is_connected(),
+              uptime / 60000, uptime % 60000 / 1000,
+              count_pressed_keys(&current_pressed_keys),
+              current_pressed_keys.wake_pressed, ctrl_cmd_swapped,
+              (double)battery_state.soc,
+              (double)(battery_state.tte_s / 60.f / 60.f),
+              (double)(battery_state.ttf_s / 60.f));
+      break;
+    case 1: {
+      // average / max delay added per key press, average in 0.1ms
+      uint32_t combo_delay = combo_stats.total_delay_ms * 10 /
+                             MAX(combo_stats.n_presses, 1);
+      sprintf(str,
+              "input\nscan: %dHz\njitter: %dus\nscan time: %dus\ntier: "
+              "%s\nevent ovf: %d\ncombo: +%d.%d/%dms\nbuffer: %d lost %d",
+              scan_stats.rate_hz, scan_stats.jitter_us, scan_stats.scan_us,
+              scan_tier_name(scan_stats.tier),
+              (int)atomic_get(&key_event_overflows), combo_delay / 10,
+              combo_delay % 10, combo_stats.max_delay_ms,
+              key_buffer_stats.n_replayed, key_buffer_stats.n_discarded);
+      break;
+    }
+    case 2:
+      sprintf(str,
+              "ble\ninterval: %dus lat %d\nsub %d req %d rej %d\n"
+              "macros: %d %dcps\nhid q: %d/%d retry %d\nmerge: %d drop: %d\n"
+              "wake: %d/%dms %s host %d\nadv %s: %duA/%duA",
+              ble_conn_interval_us(), conn_params_stats.latency,
+              conn_params_stats.subrate_factor, conn_params_stats.n_requests,
+              conn_params_stats.n_rejected, macro_stats.n_played,
+              macro_stats.cps, hid_queue_depth(), hid_queue_stats.max_depth,
+              hid_queue_stats.n_retries, hid_queue_stats.n_coalesced,
+              hid_queue_stats.n_dropped, reconnect_stats.connect_ms,
+              reconnect_stats.first_report_ms,
+              reconnect_stats.phase ? reconnect_stats.phase : "-",
+              ble_host_slot() + 1, adv_stats.tier ? adv_stats.tier : "-",
+              adv_stats.fast_ua, adv_stats.slow_ua);
+      break;
+    case 3:
+      sprintf(str,
+              "display\nbus: %dkHz\nframe: %dB\nframes: %d\ndropped: %d\n"
+              "errors: %d",
+              display_stats.bus_khz, display_stats.last_frame_bytes,
+              display_stats.n_frames, display_stats.n_dropped,
+              display_stats.n_errors);
+      break;
+  }
 
   lcd_goto_xpix_y(0, 0);
   lcd_clear_buffer();
@@ -299,10 +361,13 @@ void show_help_page(struct ui_message msg, struct ui_state *state) {
   lcd_puts("D: debug info\n");
   lcd_puts("W: swap ctrl & cmd\n");
   lcd_puts("A: apps menu\n");
+  lcd_puts("P: pair new host\n");
+  lcd_puts("1-4: switch host\n");
   lcd_display();
 }
 
 void run_application(void (*app_func)(void)) {
+  reset_app_keys();
   application_running = true;
   app_func();
   application_running = false;
@@ -348,6 +413,36 @@ void show_apps_page(struct ui_message msg, struct ui_state *state) {
   lcd_display();
 }
 
+void show_pair_page(struct ui_message msg, struct ui_state *state) {
+  if (state->page_state.idx == 0) {
+    state->page_state.idx = 1;
+    ble_advertise_open();
+  }
+  lcd_goto_xpix_y(0, 0);
+  lcd_clear_buffer();
+  lcd_puts("pairing\n\nadvertising to\nany host");
+  lcd_display();
+}
+
+void show_host_page(struct ui_message msg, struct ui_state *state) {
+  uint8_t slot = state->current_page - UI_PAGE_HOST_1;
+  if (state->page_state.idx == 0) {
+    state->page_state.idx = 1;
+    ble_select_host_slot(slot);
+  }
+  char str[64];
+  if (ble_is_ready() && ble_host_slot() == slot) {
+    sprintf(str, "host %d\n\nconnected in %dms", slot + 1,
+            reconnect_stats.connect_ms);
+  } else {
+    sprintf(str, "host %d\n\nconnecting", slot + 1);
+  }
+  lcd_goto_xpix_y(0, 0);
+  lcd_clear_buffer();
+  lcd_puts(str);
+  lcd_display();
+}
+
 void show_idle_page(struct ui_message msg, struct ui_state *state) {
   show_animation(&state->page_state.anim, &anim_idle, true);
 }
@@ -377,7 +472,14 @@ struct ui_page_cfg ui_page_cfgs[__UI_N_PAGES] = {
     {show_help_page, UI_MESSAGE_TYPE_WAKE_AND_KEY_PRESSED, {0, 7}, true},
     {show_apps_page, UI_MESSAGE_TYPE_WAKE_AND_KEY_PRESSED, {1, 2}, false},
     {show_idle_page, UI_MESSAGE_TYPE_WAKE_PRESSED, NO_KEY, true},
+    {show_pair_page, UI_MESSAGE_TYPE_WAKE_AND_KEY_PRESSED, {2, 3}, true},
+    // the digits of the number layer
+    {show_host_page, UI_MESSAGE_TYPE_WAKE_AND_KEY_PRESSED, {2, 7}, true},
+    {show_host_page, UI_MESSAGE_TYPE_WAKE_AND_KEY_PRESSED, {2, 8}, true},
+    {show_host_page, UI_MESSAGE_TYPE_WAKE_AND_KEY_PRESSED, {2, 9}, true},
+    {show_host_page, UI_MESSAGE_TYPE_WAKE_AND_KEY_PRESSED, {1, 7}, true},
 };
+BUILD_ASSERT(UI_PAGE_HOST_4 - UI_PAGE_HOST_1 + 1 == N_HOST_SLOTS);
 
 void switch_page(struct ui_state *state, struct ui_message *msg) {
   for (int i = 0; i < __UI_N_PAGES; i++) {
@@ -433,6 +535,10 @@ void ui_thread() {
       if (ui_page_cfgs[state->current_page].allow_navigation) {
         switch_page(state, &msg);
       }
+    } else {
+      // pages are shown again without a new message, keep the data of the
+      // last one but don't handle it twice
+      msg.type = UI_MESSAGE_TYPE_NOMSG;
     }
     if ((k_uptime_get() - state->last_msg_time) > UI_TIMEOUT_MS) {
       switch_off(state);